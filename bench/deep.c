@@ -0,0 +1,70 @@
+/* Stress benchmark for deeply nested values.
+ * Builds {{{...}}} nested 10M levels deep (or argv[1]) and times the
+ * walks over it: hash, promote (deep copy), eq, print and del. None of
+ * them may recurse per level, so this must finish without growing the
+ * C stack.
+ *
+ * Build from the repository root:
+ *   cc -std=gnu11 -O2 -I. bench/deep.c lval.c lenv.c lgc.c lalloc.c \
+ *       lintern.c lstr.c lreap.c mpc.c -lm -lpthread -o deep
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "lval.h"
+
+#define DEPTH_DEFAULT (10 * 1000 * 1000)
+
+static double now(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void report(const char* what, double start)
+{
+	fprintf(stderr, "%-8s %8.3fs\n", what, now() - start);
+}
+
+int main(int argc, char** argv)
+{
+	long depth = argc > 1 ? strtol(argv[1], NULL, 10) : DEPTH_DEFAULT;
+	fprintf(stderr, "depth %ld\n", depth);
+
+	double t = now();
+	lval* v = lval_qexpr();
+	for (long i = 0; i < depth; i++)
+	{
+		v = lval_add(lval_qexpr(), v);
+	}
+	report("build", t);
+
+	t = now();
+	unsigned int h = lval_hash(v);
+	report("hash", t);
+
+	t = now();
+	lval* w = lval_promote(v);
+	report("promote", t);
+
+	t = now();
+	int eq = lval_eq(v, w);
+	report("eq", t);
+
+	/* Printing goes nowhere, only the walk is measured */
+	t = now();
+	if (!freopen("/dev/null", "w", stdout)) return 1;
+	lval_print(v);
+	fflush(stdout);
+	report("print", t);
+
+	t = now();
+	lval_del(v);
+	lval_del(w);
+	report("del", t);
+
+	fprintf(stderr, "hash %u, eq %d\n", h, eq);
+	return !eq;
+}
@@ -0,0 +1,98 @@
+/* Lookup cost against environment size.
+ * Fills a top-level environment with N bindings for growing N and times
+ * lenv_get on names spread over the whole environment, plus a miss that
+ * falls through to the parent. The cost per lookup should stay flat.
+ *
+ * Build from the repository root:
+ *   cc -std=gnu11 -O2 -I. bench/env.c lval.c lenv.c lgc.c lalloc.c \
+ *       lintern.c lstr.c lreap.c mpc.c -lm -lpthread -o env
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "lval.h"
+#include "lenv.h"
+
+#define LOOKUPS (4 * 1000 * 1000)
+
+static double now(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static lval* sym(long i)
+{
+	char name[32];
+	snprintf(name, sizeof(name), "name-%ld", i);
+	return lval_sym(name);
+}
+
+/* Nanoseconds per lookup of the keys in ks, cycling through them */
+static double time_gets(lenv* e, lval** ks, int n)
+{
+	long sum = 0;
+	double t = now();
+	for (long i = 0; i < LOOKUPS; i++)
+	{
+		lval* v = lenv_get(e, ks[i % n]);
+		sum += lval_type(v);
+		lval_del(v);
+	}
+	t = now() - t;
+	return sum < 0 ? 0 : t * 1e9 / LOOKUPS;
+}
+
+int main(void)
+{
+	fprintf(stderr, "%8s %10s %10s\n", "size", "hit ns", "miss ns");
+
+	for (long size = 1; size <= 100000; size *= 10)
+	{
+		lenv* root = lenv_new();
+		for (long i = 0; i < size; i++)
+		{
+			lval* k = sym(i);
+			lval* v = lval_num(i);
+			lenv_put(root, k, v);
+			lval_del(k);
+			lval_del(v);
+		}
+
+		/* Lookups start in a small local environment, like a call would */
+		lenv* local = lenv_new();
+		local->par = root;
+		for (long i = 0; i < 2; i++)
+		{
+			lval* k = sym(-1 - i);
+			lval* v = lval_num(i);
+			lenv_put(local, k, v);
+			lval_del(k);
+			lval_del(v);
+		}
+
+		/* 64 names spread evenly over the environment */
+		lval* hits[64];
+		lval* misses[64];
+		for (int i = 0; i < 64; i++)
+		{
+			hits[i] = sym(i * size / 64);
+			misses[i] = sym(size + i);
+		}
+
+		double hit = time_gets(local, hits, 64);
+		double miss = time_gets(local, misses, 64);
+		fprintf(stderr, "%8ld %10.1f %10.1f\n", size, hit, miss);
+
+		for (int i = 0; i < 64; i++)
+		{
+			lval_del(hits[i]);
+			lval_del(misses[i]);
+		}
+		lenv_del(local);
+		lenv_del(root);
+	}
+	return 0;
+}
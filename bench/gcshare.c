@@ -0,0 +1,84 @@
+/* Check that values stay shared under the collector.
+ * With --gc lval_del does nothing, so counts are never lowered. A
+ * global list is copied about 2^32 times (or argv[1]), as many lookups
+ * would, then tail and join on copies of it must leave the global
+ * untouched. Exits non-zero on failure.
+ *
+ * Build from the repository root:
+ *   cc -std=gnu11 -O2 -I. bench/gcshare.c lval.c lenv.c lgc.c lalloc.c \
+ *       lintern.c lstr.c lreap.c mpc.c -lm -lpthread -o gcshare
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "lval.h"
+#include "lenv.h"
+#include "lgc.h"
+
+#define COPIES_WRAP (1L << 32)
+
+static lval* list(int n)
+{
+	lval* v = lval_qexpr();
+	for (int i = 1; i <= n; i++)
+	{
+		v = lval_add(v, lval_num(i));
+	}
+	return v;
+}
+
+static int check(const char* what, lval* got, lval* want)
+{
+	if (lval_eq(got, want)) return 0;
+	printf("%s: global changed to ", what);
+	lval_println(got);
+	return 1;
+}
+
+int main(int argc, char** argv)
+{
+	long copies = argc > 1 ? strtol(argv[1], NULL, 10) : 0;
+	int failed = 0;
+
+	lgc_enable(4 * 1024 * 1024);
+	lenv* e = lenv_new();
+	lgc_push(e, NULL);
+
+	lval* k = lval_sym("xs");
+	lval* want = list(5);
+	lgc_push(NULL, want);
+	lenv_put(e, k, list(5));
+
+	/* Copies are never given back. Take enough of them that a wrapping
+	 * count would read one on the next lenv_get. */
+	lval* xs = lenv_get(e, k);
+	if (!copies) copies = COPIES_WRAP - xs->refs;
+	for (long i = 0; i < copies; i++)
+	{
+		lval_del(lval_copy(xs));
+	}
+
+	/* tail, as builtin_tail does it */
+	for (int i = 0; i < 1000; i++)
+	{
+		lval* v = lval_own(lenv_get(e, k));
+		lval_del(lval_pop(v, 0));
+		lval_del(v);
+		lgc_maybe_collect();
+	}
+	failed |= check("tail", lenv_get(e, k), want);
+
+	/* join on both sides */
+	lval* v = lval_join(lenv_get(e, k), lval_add(lval_qexpr(), lval_num(6)));
+	lval_del(v);
+	failed |= check("join after", lenv_get(e, k), want);
+	v = lval_join(lval_add(lval_qexpr(), lval_num(0)), lenv_get(e, k));
+	lval_del(v);
+	failed |= check("join before", lenv_get(e, k), want);
+
+	lgc_collect();
+	failed |= check("collect", lenv_get(e, k), want);
+
+	fprintf(stderr, "%s\n", failed ? "FAILED" : "ok");
+	return failed;
+}
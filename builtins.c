@@ -2,6 +2,18 @@
 
 #include "builtins.h"
 #include "macros.h"
+#include "lalloc.h"
+#include "lgc.h"
+#include "lintern.h"
+#include "lreap.h"
+
+/* The interned '&' symbol */
+static char* sym_rest(void)
+{
+	static char* s = NULL;
+	if (!s) s = lintern("&");
+	return s;
+}
 
 lval* builtin_lambda(lenv* e, lval* a)
 {
@@ -14,9 +26,9 @@ lval* builtin_lambda(lenv* e, lval* a)
 	/* First Q-EXPR is set of params / formals, check it contains only symbols */
 	for (int i = 0; i < a->cell[0]->count; ++i)
 	{
-		LASSERT(a, (a->cell[0]->cell[i]->type == LVAL_SYM),
-				"Cannot define non-symbol. Got %s, Expected %s.",
-				ltype_name(a->cell[0]->cell[i]->type),ltype_name(LVAL_SYM));
+		LASSERT(a, (lval_type(a->cell[0]->cell[i]) == LVAL_SYM),
+				LERR_NOT_SYMBOL,
+				ltype_name(lval_type(a->cell[0]->cell[i])),ltype_name(LVAL_SYM));
 	}
 
 	/* Set formals and body*/
@@ -24,11 +36,24 @@ lval* builtin_lambda(lenv* e, lval* a)
 	lval* body = lval_pop(a, 0);
 	lval_del(a);
 
+	/* Lay the formals out the way a call binds them (skipping '&'), so
+	 * references to them in the body go straight to their slot. Scoping
+	 * is dynamic, other names are only known when they are looked up. */
+	lenv* frame = lenv_new();
+	for (int i = 0; i < formals->count; i++)
+	{
+		if (formals->cell[i]->sym == sym_rest()) continue;
+		lenv_put(frame, formals->cell[i], lval_num(0));
+	}
+	lval_resolve(body, frame);
+	lenv_del(frame);
+
 	return lval_lambda(formals, body);
 }
 
 lval* builtin_list(lenv* e, lval* a)
 {
+	a = lval_own(a);
 	a->type = LVAL_QEXPR;
 	return a;
 }
@@ -43,12 +68,10 @@ lval* builtin_head(lenv* e, lval* a)
 	/* Otherwise take first argument */
 	lval* v = lval_take(a, 0);
 
-	/* Delete rest of elements in list */
-	while (v->count > 1)
-	{
-		lval_del(lval_pop(v, 1));
-	}
-	return v;
+	/* Build a new list around the first element, v may be shared */
+	lval* x = lval_add(lval_qexpr(), lval_copy(v->cell[0]));
+	lval_del(v);
+	return x;
 }
 
 lval* builtin_tail(lenv* e, lval* a)
@@ -58,21 +81,58 @@ lval* builtin_tail(lenv* e, lval* a)
 	LASSERT_TYPE("tail", a, 0, LVAL_QEXPR);
 	LASSERT_NOT_EMPTY("tail", a, 0);
 
-	lval* v = lval_take(a, 0);
+	lval* v = lval_own(lval_take(a, 0));
 	/*Delete first element and return*/
 	lval_del(lval_pop(v, 0));
 	return v;
 }
 
+lval* builtin_take(lenv* e, lval* a)
+{
+	LASSERT_NUM("take", a, 2);
+	LASSERT_TYPE("take", a, 0, LVAL_NUM);
+	LASSERT_TYPE("take", a, 1, LVAL_QEXPR);
+
+	long n = lval_num_val(a->cell[0]);
+	LASSERT_RANGE("take", a, 1, 0, n);
+
+	return lval_slice(lval_take(a, 1), 0, n);
+}
+
+lval* builtin_drop(lenv* e, lval* a)
+{
+	LASSERT_NUM("drop", a, 2);
+	LASSERT_TYPE("drop", a, 0, LVAL_NUM);
+	LASSERT_TYPE("drop", a, 1, LVAL_QEXPR);
+
+	long n = lval_num_val(a->cell[0]);
+	int count = a->cell[1]->count;
+	LASSERT_RANGE("drop", a, 1, n, count);
+
+	return lval_slice(lval_take(a, 1), n, count);
+}
+
+lval* builtin_slice(lenv* e, lval* a)
+{
+	LASSERT_NUM("slice", a, 3);
+	LASSERT_TYPE("slice", a, 0, LVAL_NUM);
+	LASSERT_TYPE("slice", a, 1, LVAL_NUM);
+	LASSERT_TYPE("slice", a, 2, LVAL_QEXPR);
+
+	long start = lval_num_val(a->cell[0]);
+	long end = lval_num_val(a->cell[1]);
+	LASSERT_RANGE("slice", a, 2, start, end);
+
+	return lval_slice(lval_take(a, 2), start, end);
+}
+
 lval* builtin_eval(lenv* e, lval* a)
 {
 	/*Check error conditions */
 	LASSERT_NUM("eval", a, 1);
 	LASSERT_TYPE("eval", a, 0, LVAL_QEXPR);
 
-	lval* x = lval_take(a, 0);
-	x->type = LVAL_SEXPR;
-	return lval_eval(e, x);
+	return lval_eval_sexpr(e, lval_take(a, 0));
 }
 
 lval* builtin_join(lenv* e, lval* a)
@@ -103,47 +163,44 @@ lval* builtin_op(lenv*e, lval* a, char* op)
 		LASSERT_TYPE(op, a, i, LVAL_NUM);
 	}
 
-	lval* x = lval_pop(a, 0);
+	/* Operands are read in place, immediate numbers need no unboxing */
+	long x = lval_num_val(a->cell[0]);
 
 	/* If no args & unary operator */
-	if ((!strcmp(op, "-")) && a->count == 0)
+	if ((!strcmp(op, "-")) && a->count == 1)
 	{
-		x->num = - x->num;
+		x = -x;
 	}
 
-	while (a->count)
+	for (int i = 1; i < a->count; ++i)
 	{
-		lval* y = lval_pop(a, 0);
+		long y = lval_num_val(a->cell[i]);
 
 		if (!strcmp(op, "+"))
 		{
-			x->num += y->num;
+			x += y;
 		}
 		if (!strcmp(op, "-"))
 		{
-			x->num -= y->num;
+			x -= y;
 		}
 		if (!strcmp(op, "*"))
 		{
-			x->num *= y->num;
+			x *= y;
 		}
 		if (!strcmp(op, "/"))
 		{
-			if (y->num == 0)
+			if (y == 0)
 			{
-				lval_del(x);
-				lval_del(y);
-				x = lval_err("Division by zero!!");
-				break;
+				lval_del(a);
+				return lval_err(LERR_DIV_ZERO);
 			}
-			x->num /= y->num;
+			x /= y;
 		}
-
-		lval_del(y);
 	}
 
 	lval_del(a);
-	return x;
+	return lval_num(x);
 }
 
 lval* builtin_add(lenv* e, lval* a)
@@ -172,19 +229,19 @@ lval* builtin_ord(lenv* e, lval* a, char* func)
 	int result = 0;
 	if (!strcmp(func, ">"))
 	{
-		result = (a->cell[0]->num > a->cell[1]->num);
+		result = (lval_num_val(a->cell[0]) > lval_num_val(a->cell[1]));
 	}
 	else if (!strcmp(func, "<"))
 	{
-		result = (a->cell[0]->num < a->cell[1]->num);
+		result = (lval_num_val(a->cell[0]) < lval_num_val(a->cell[1]));
 	}
 	else if (!strcmp(func, ">="))
 	{
-		result = (a->cell[0]->num >= a->cell[1]->num);
+		result = (lval_num_val(a->cell[0]) >= lval_num_val(a->cell[1]));
 	}
 	else if (!strcmp(func, "<="))
 	{
-		result = (a->cell[0]->num <= a->cell[1]->num);
+		result = (lval_num_val(a->cell[0]) <= lval_num_val(a->cell[1]));
 	}
 	lval_del(a);
 	return lval_num(result);
@@ -213,7 +270,7 @@ lval* builtin_le(lenv* e, lval* a)
 lval* builtin_cmp(lenv* e, lval* a, char* op)
 {
 	LASSERT_NUM(op, a, 2);
-	int r;
+	int r = 0;
 	if (strcmp(op, "==") == 0)
 	{
 		r =  lval_eq(a->cell[0], a->cell[1]);
@@ -236,6 +293,16 @@ lval* builtin_ne(lenv* e, lval* a)
 	return builtin_cmp(e, a, "!=");
 }
 
+lval* builtin_hash(lenv* e, lval* a)
+{
+	LASSERT_NUM("hash", a, 1);
+
+	/* Values that are == hash equal */
+	lval* x = lval_num(lval_hash(a->cell[0]));
+	lval_del(a);
+	return x;
+}
+
 lval* builtin_if(lenv* e, lval* a)
 {
 	LASSERT_NUM("if", a, 3);
@@ -243,22 +310,21 @@ lval* builtin_if(lenv* e, lval* a)
 	LASSERT_TYPE("if", a, 1, LVAL_QEXPR);
 	LASSERT_TYPE("if", a, 2, LVAL_QEXPR);
 
-	/* Mark Both Expressions as evaluable */
 	lval* x;
-	a->cell[1]->type = LVAL_SEXPR;
-	a->cell[2]->type = LVAL_SEXPR;
-
-	if (a->cell[0]->num)
+	if (lval_num_val(a->cell[0]))
 	{
-		/* If condition is true evaluate first expression */
-		x = lval_eval(e, lval_pop(a, 1));
+		/* If condition is true take first expression */
+		x = lval_pop(a, 1);
 	}
 	else
 	{
-		/* Otherwise evaluate second expression */
-		x = lval_eval(e, lval_pop(a, 2));
+		/* Otherwise take second expression */
+		x = lval_pop(a, 2);
 	}
 
+	/* Evaluated in place, it may be shared with a function body */
+	x = lval_eval_sexpr(e, x);
+
 	/* Delete argument list and return */
 	lval_del(a);
 	return x;
@@ -273,15 +339,13 @@ lval* builtin_var(lenv* e, lval* a, char* func)
 	/*Ensure all elements of first list are symbols*/
 	for (int i = 0; i < syms->count; ++i)
 	{
-		LASSERT(a, (syms->cell[i]->type == LVAL_SYM),
-				"Function '%s' cannot define non-symbol. "
-				"Got %s, Expected %s.", func,
-				ltype_name(syms->cell[i]->type), ltype_name(LVAL_SYM));
+		LASSERT(a, (lval_type(syms->cell[i]) == LVAL_SYM),
+				LERR_DEF_NOT_SYMBOL, func,
+				ltype_name(lval_type(syms->cell[i])), ltype_name(LVAL_SYM));
 	}
 
 	/*Check correct number of symbols and values*/
-	LASSERT(a, (syms->count == a->count-1),
-			"Function '%s' passed too many arguments for symbols. Got %i, Expected %i.",
+	LASSERT(a, (syms->count == a->count-1), LERR_DEF_COUNT,
 			func, syms->count, a->count-1);
 
 	/*Assign copies of values to symbols*/
@@ -312,18 +376,119 @@ lval* builtin_put(lenv* e, lval* a)
 	return builtin_var(e, a, "=");
 }
 
+lval* builtin_alloc_stats(lenv* e, lval* a)
+{
+	lalloc_stats s = lalloc_get_stats();
+	unsigned long fast = s.reused + s.carved;
+
+	printf("allocs %lu, free list hits %lu, slab carves %lu, "
+			"new slabs %lu, malloc fallbacks %lu, frees %lu\n",
+			s.allocs, s.reused, s.carved, s.slabs, s.large, s.frees);
+	printf("slab hit rate %.1f%%\n",
+			s.allocs ? 100.0 * fast / s.allocs : 0.0);
+	printf("nursery allocs %lu, nursery blocks %lu\n", s.young, s.blocks);
+
+	lval_del(a);
+	return lval_sexpr();
+}
+
+lval* builtin_mem_stats(lenv* e, lval* a)
+{
+	printf("live bytes %zu, live objects %zu, peak bytes %zu\n",
+			lmem.bytes, lmem.objects, lmem.peak);
+	if (lmem.limit)
+	{
+		printf("limit %zu bytes\n", lmem.limit);
+	}
+	else
+	{
+		printf("no limit\n");
+	}
+
+	lval_del(a);
+	return lval_sexpr();
+}
+
+lval* builtin_gc(lenv* e, lval* a)
+{
+	LASSERT(a, lgc_on, LERR_NO_GC);
+
+	/* Return the number of objects freed */
+	lval_del(a);
+	return lval_num(lgc_collect());
+}
 
 /* Evaluation */
 
+/* Calls f with every formal given, binding the arguments in a call
+ * frame so that f itself is left alone. Returns NULL, consuming
+ * nothing, when the call needs the general path: f already has
+ * bindings of its own (partial application), or the arguments don't
+ * match the formals exactly. */
+static lval* lval_call_frame(lenv* e, lval* f, lval* a)
+{
+	lval* formals = f->formals;
+	int n = formals->count;
+
+	/* Formals bound one to one, a final '& rest' takes what is left */
+	int fixed = n;
+	for (int i = 0; i < n; i++)
+	{
+		if (formals->cell[i]->sym != sym_rest()) continue;
+		if (i != n - 2) return NULL;
+		fixed = i;
+	}
+	if (f->env->count || a->count < fixed) return NULL;
+	if (fixed == n && a->count != n) return NULL;
+
+	lenv* frame = lenv_push_frame(e, fixed == n ? n : fixed + 1);
+	for (int i = 0; i < fixed; i++)
+	{
+		lenv_put(frame, formals->cell[i], a->cell[i]);
+	}
+	if (fixed < n)
+	{
+		lval* rest = lval_slice(a, fixed, a->count);
+		rest->type = LVAL_QEXPR;
+		lenv_put(frame, formals->cell[n - 1], rest);
+		lval_del(rest);
+	}
+	else
+	{
+		lval_del(a);
+	}
+
+	/* The body is read in place, not copied */
+	lval* result = lval_eval_sexpr(frame, lval_copy(f->body));
+
+	lenv_pop_frame();
+	lval_del(f);
+	return result;
+}
+
 lval* lval_call(lenv* e, lval* f, lval* a)
 {
 
 	/* If Builtin then simply apply that */
 	if (f->builtin)
 	{
-		return f->builtin(e, a);
+		lval* result = f->builtin(e, a);
+		lval_del(f);
+		return result;
 	}
 
+	lval* result = lval_call_frame(e, f, a);
+	if (result) return result;
+
+	/* Binding consumes the formals and fills the environment, so make
+	 * sure this call has its own function, formals and environment */
+	f = lval_own(f);
+	f->formals = lval_own(f->formals);
+	f->env = lenv_own(f->env);
+
+	/* Set environment parent to evaluation environment */
+	f->env->par = e;
+
 	/* Record Argument Counts */
 	int given = a->count;
 	int total = f->formals->count;
@@ -335,25 +500,25 @@ lval* lval_call(lenv* e, lval* f, lval* a)
 		/* If we've ran out of formal arguments to bind */
 		if (f->formals->count == 0)
 		{
+			lval_del(f);
 			lval_del(a);
-			return lval_err(
-					"Function passed too many arguments. "
-					"Got %i, Expected %i.", given, total);
+			return lval_err(LERR_TOO_MANY_ARGS, given, total);
 		}
 
 		/* Pop the first symbol from the formals */
 		lval* sym = lval_pop(f->formals, 0);
 
 		/* Special Case to deal with '&' */
-		if (strcmp(sym->sym, "&") == 0)
+		if (sym->sym == sym_rest())
 		{
 
 			/* Ensure '&' is followed by another symbol */
 			if (f->formals->count != 1)
 			{
+				lval_del(sym);
+				lval_del(f);
 				lval_del(a);
-				return lval_err("Function format invalid. "
-						"Symbol '&' not followed by single symbol.");
+				return lval_err(LERR_BAD_FORMALS);
 			}
 
 			/* Next formal should be bound to remaining arguments */
@@ -380,14 +545,14 @@ lval* lval_call(lenv* e, lval* f, lval* a)
 
 	/* If '&' remains in formal list bind to empty list */
 	if (f->formals->count > 0 &&
-			strcmp(f->formals->cell[0]->sym, "&") == 0)
+			f->formals->cell[0]->sym == sym_rest())
 	{
 
 		/* Check to ensure that & is not passed invalidly. */
 		if (f->formals->count != 2)
 		{
-			return lval_err("Function format invalid. "
-					"Symbol '&' not followed by single symbol.");
+			lval_del(f);
+			return lval_err(LERR_BAD_FORMALS);
 		}
 
 		/* Pop and delete '&' symbol */
@@ -407,31 +572,29 @@ lval* lval_call(lenv* e, lval* f, lval* a)
 	if (f->formals->count == 0)
 	{
 
-		/* Set environment parent to evaluation environment */
-		f->env->par = e;
-
 		/* Evaluate and return */
-		return builtin_eval(
+		lval* result = builtin_eval(
 				f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
+		lval_del(f);
+		return result;
 	}
 	else
 	{
-		/* Otherwise return partially evaluated function */
-		return lval_copy(f);
+		/* Otherwise return partially evaluated function. The caller's
+		 * environment may be a call frame about to be popped, the next
+		 * call sets the parent again. */
+		f->env->par = NULL;
+		return f;
 	}
 
 }
 
-lval* lval_eval_sexpr(lenv* e, lval* v)
+/* Applies the first cell of the evaluated v to the rest */
+static lval* lval_apply_cells(lenv* e, lval* v)
 {
 	for (int i = 0; i < v->count; ++i)
 	{
-		v->cell[i] = lval_eval(e, v->cell[i]);
-	}
-
-	for (int i = 0; i < v->count; ++i)
-	{
-		if (v->cell[i]->type == LVAL_ERR) return lval_take(v, i);
+		if (lval_type(v->cell[i]) == LVAL_ERR) return lval_take(v, i);
 	}
 
 	if (v->count == 0) return v;
@@ -439,32 +602,110 @@ lval* lval_eval_sexpr(lenv* e, lval* v)
 	if (v->count == 1) return lval_take(v, 0);
 
 	lval* f = lval_pop(v, 0);
-	if (f->type != LVAL_FUN)
+	if (lval_type(f) != LVAL_FUN)
 	{
-		lval* err = lval_err(
-				"S-Expression starts with incorrect type. "
-				"Got %s, Expected %s.",
-				ltype_name(f->type), ltype_name(LVAL_FUN));
+		lval* err = lval_err(LERR_NOT_FUNCTION,
+				ltype_name(lval_type(f)), ltype_name(LVAL_FUN));
 		lval_del(f);
 		lval_del(v);
 		return err;
 	}
 
+	/* The function is no longer in v, keep it rooted during the call */
+	lgc_push(NULL, f);
 	lval* result = lval_call(e, f, v);
-	lval_del(f);
+	lgc_pop();
+	return result;
+}
+
+/* Evaluates a cell of an expression that is only read, not consumed */
+static lval* lval_eval_cell(lenv* e, lval* c)
+{
+	if (lval_type(c) == LVAL_SYM) return lenv_get(e, c);
+	return lval_eval(e, lval_copy(c));
+}
+
+/* Evaluates the cells of v as an S-Expression whatever its type, so a
+ * quoted body can be passed as is. A shared v, like a function body, is
+ * read in place and its results go to a new list. Otherwise they are
+ * stored back into v. */
+lval* lval_eval_sexpr(lenv* e, lval* v)
+{
+	int shared = v->refs > 1 || (v->flags & LVAL_STATIC) ||
+		(v->cell && lcells_of(v)->refs > 1);
+	lval* x = v;
+	if (shared)
+	{
+		x = lval_sexpr_sized(v->count);
+	}
+	else
+	{
+		lval_own_cells(v);
+		v->type = LVAL_SEXPR;
+	}
+
+	/* Keep v, the results and the environment reachable for the
+	 * collector. Callers keep what they still need in a root further
+	 * down, so this is a safepoint and the collector may run in the
+	 * middle of a form. */
+	lgc_push(e, v);
+	if (shared) lgc_push(NULL, x);
+	lgc_maybe_collect();
+
+	/* Over the memory limit, unwind to the top level. Memory given to
+	 * the reaper is still counted until it is drained, so finish that
+	 * first. */
+	if (lmem_over()) lreap_wait();
+	if (lmem_over())
+	{
+		if (shared)
+		{
+			lgc_pop();
+			lval_del(x);
+		}
+		lgc_pop();
+		lval_del(v);
+		return lval_err(LERR_MEM_LIMIT);
+	}
+
+	if (shared)
+	{
+		/* x has room for every cell, it only counts the ones filled */
+		for (int i = 0; i < v->count; ++i)
+		{
+			x->cell[i] = lval_eval_cell(e, v->cell[i]);
+			x->count++;
+			lcells_of(x)->len++;
+		}
+	}
+	else
+	{
+		for (int i = 0; i < v->count; ++i)
+		{
+			v->cell[i] = lval_eval(e, v->cell[i]);
+		}
+	}
+
+	lval* result = lval_apply_cells(e, x);
+	if (shared)
+	{
+		lgc_pop();
+		lval_del(v);
+	}
+	lgc_pop();
 	return result;
 }
 
 lval* lval_eval(lenv* e, lval* v)
 {
-	if (v->type == LVAL_SYM)
+	if (lval_type(v) == LVAL_SYM)
 	{
 		lval* x = lenv_get(e, v);
 		lval_del(v);
 		return x;
 	}
 
-	if (v->type == LVAL_SEXPR) return lval_eval_sexpr(e, v);
+	if (lval_type(v) == LVAL_SEXPR) return lval_eval_sexpr(e, v);
 
 	return v;
 }
@@ -475,7 +716,7 @@ lval* lval_read_num(mpc_ast_t* t)
 {
 	errno = 0;
 	long x = strtol(t->contents, NULL, 10);
-	return errno != ERANGE ? lval_num(x) : lval_err("Invalid number");
+	return errno != ERANGE ? lval_num(x) : lval_err(LERR_BAD_NUMBER);
 }
 
 lval* lval_read_str(mpc_ast_t* t)
@@ -525,5 +766,5 @@ lval* lval_read(mpc_ast_t* t)
 		x = lval_add(x, lval_read(t->children[i]));
 	}
 
-	return x;
+	return lval_hashcons(x);
 }
@@ -6,6 +6,9 @@ lval* builtin_lambda(lenv* e, lval* a);
 lval* builtin_list(lenv* e, lval* a);
 lval* builtin_head(lenv* e, lval* a);
 lval* builtin_tail(lenv* e, lval* a);
+lval* builtin_take(lenv* e, lval* a);
+lval* builtin_drop(lenv* e, lval* a);
+lval* builtin_slice(lenv* e, lval* a);
 lval* builtin_eval(lenv* e, lval* a);
 lval* builtin_join(lenv* e, lval* a);
 lval* builtin_op(lenv*e, lval* a, char* op);
@@ -21,11 +24,16 @@ lval* builtin_le(lenv* e, lval* a);
 lval* builtin_cmp(lenv* e, lval* a, char* op);
 lval* builtin_eq(lenv* e, lval* a);
 lval* builtin_ne(lenv* e, lval* a);
+lval* builtin_hash(lenv* e, lval* a);
 lval* builtin_if(lenv* e, lval* a);
 lval* builtin_var(lenv* e, lval* a, char* func);
 lval* builtin_def(lenv* e, lval* a);
 lval* builtin_put(lenv* e, lval* a);
+lval* builtin_alloc_stats(lenv* e, lval* a);
+lval* builtin_mem_stats(lenv* e, lval* a);
+lval* builtin_gc(lenv* e, lval* a);
 
+/* Consumes both the function and the argument list */
 lval* lval_call(lenv* e, lval* f, lval* a);
 lval* lval_eval_sexpr(lenv* e, lval* v);
 lval* lval_eval(lenv* e, lval* v);
@@ -0,0 +1,260 @@
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "lalloc.h"
+
+#define LALLOC_ALIGN (8)
+#define LALLOC_CLASSES (8)
+#define LALLOC_SLAB_SIZE (64 * 1024)
+#define LNURSERY_BLOCK (64 * 1024)
+#define LNURSERY_SPARES (8)
+
+typedef struct lfree_node
+{
+	struct lfree_node* next;
+} lfree_node;
+
+/* Per size class: recycled blocks, then the unused tail of the last slab */
+typedef struct lalloc_class
+{
+	lfree_node* free;
+	char* bump;
+	char* end;
+} lalloc_class;
+
+/* Nursery blocks are aligned to their size so an object finds its
+ * block header by masking its address */
+typedef struct lnursery_block
+{
+	long live;
+	struct lnursery_block* next;
+} lnursery_block;
+
+static _Thread_local lalloc_stats stats;
+
+_Thread_local lmem_stats lmem;
+
+#ifndef LALLOC_MALLOC
+static _Thread_local lalloc_class classes[LALLOC_CLASSES];
+
+static int lalloc_class_of(size_t size)
+{
+	return (size + LALLOC_ALIGN - 1) / LALLOC_ALIGN - 1;
+}
+#endif
+
+void* lalloc(size_t size)
+{
+	stats.allocs++;
+
+#ifndef LALLOC_MALLOC
+	int i = lalloc_class_of(size);
+	if (i < LALLOC_CLASSES)
+	{
+		lalloc_class* c = &classes[i];
+
+		/* Fast path, reuse a freed block */
+		if (c->free)
+		{
+			lfree_node* n = c->free;
+			c->free = n->next;
+			stats.reused++;
+			return n;
+		}
+
+		/* Otherwise carve one out of the slab, starting a new one if full */
+		size_t csize = (i + 1) * LALLOC_ALIGN;
+		if ((size_t)(c->end - c->bump) < csize)
+		{
+			c->bump = malloc(LALLOC_SLAB_SIZE);
+			c->end = c->bump + LALLOC_SLAB_SIZE;
+			stats.slabs++;
+		}
+		void* p = c->bump;
+		c->bump += csize;
+		stats.carved++;
+		return p;
+	}
+#endif
+
+	stats.large++;
+	return malloc(size);
+}
+
+void lfree(void* p, size_t size)
+{
+	stats.frees++;
+
+#ifndef LALLOC_MALLOC
+	int i = lalloc_class_of(size);
+	if (i < LALLOC_CLASSES)
+	{
+		lfree_node* n = p;
+		n->next = classes[i].free;
+		classes[i].free = n;
+		return;
+	}
+#endif
+
+	free(p);
+}
+
+#ifndef LALLOC_MALLOC
+static _Thread_local lnursery_block* young;
+static _Thread_local char* young_bump;
+static _Thread_local char* young_end;
+static _Thread_local lnursery_block* young_spare;
+static _Thread_local int young_nspare;
+
+static lnursery_block* lnursery_block_of(void* p)
+{
+	return (lnursery_block*)((uintptr_t)p & ~(uintptr_t)(LNURSERY_BLOCK - 1));
+}
+
+static lnursery_block* lnursery_take_block(void)
+{
+	if (young_spare)
+	{
+		lnursery_block* b = young_spare;
+		young_spare = b->next;
+		young_nspare--;
+		return b;
+	}
+	stats.blocks++;
+	return aligned_alloc(LNURSERY_BLOCK, LNURSERY_BLOCK);
+}
+
+static void lnursery_give_block(lnursery_block* b)
+{
+	if (young_nspare < LNURSERY_SPARES)
+	{
+		b->next = young_spare;
+		young_spare = b;
+		young_nspare++;
+	}
+	else
+	{
+		free(b);
+	}
+}
+
+static void lnursery_next_block(void)
+{
+	/* The current block can simply be rewound if nothing in it is live,
+	 * otherwise it is left to its last object to release */
+	if (!young || young->live)
+	{
+		young = lnursery_take_block();
+		young->live = 0;
+	}
+	young_bump = (char*)(young + 1);
+	young_end = (char*)young + LNURSERY_BLOCK;
+}
+#endif
+
+void* lalloc_young(size_t size)
+{
+	stats.young++;
+
+#ifndef LALLOC_MALLOC
+	size = (size + LALLOC_ALIGN - 1) & ~(size_t)(LALLOC_ALIGN - 1);
+	if ((size_t)(young_end - young_bump) < size)
+	{
+		lnursery_next_block();
+	}
+	void* p = young_bump;
+	young_bump += size;
+	young->live++;
+	return p;
+#else
+	return malloc(size);
+#endif
+}
+
+void lfree_young(void* p)
+{
+#ifndef LALLOC_MALLOC
+	lnursery_block* b = lnursery_block_of(p);
+	if (--b->live) return;
+
+	if (b == young)
+	{
+		/* Everything in the current block is dead, start over */
+		young_bump = (char*)(young + 1);
+	}
+	else
+	{
+		lnursery_give_block(b);
+	}
+#else
+	free(p);
+#endif
+}
+
+/* Region blocks are chained to the block filled before them. Without
+ * the slabs every allocation is its own link. */
+static _Thread_local lnursery_block* region;
+#ifndef LALLOC_MALLOC
+static _Thread_local char* region_bump;
+static _Thread_local char* region_end;
+#endif
+
+void* lalloc_region(size_t size)
+{
+	stats.young++;
+
+#ifndef LALLOC_MALLOC
+	size = (size + LALLOC_ALIGN - 1) & ~(size_t)(LALLOC_ALIGN - 1);
+	if ((size_t)(region_end - region_bump) < size)
+	{
+		lnursery_block* b = lnursery_take_block();
+		b->next = region;
+		region = b;
+		region_bump = (char*)(b + 1);
+		region_end = (char*)b + LNURSERY_BLOCK;
+	}
+	void* p = region_bump;
+	region_bump += size;
+	return p;
+#else
+	lnursery_block* b = malloc(sizeof(lnursery_block) + size);
+	b->next = region;
+	region = b;
+	return b + 1;
+#endif
+}
+
+lregion_mark lalloc_region_mark(void)
+{
+	lregion_mark m;
+	m.block = region;
+#ifndef LALLOC_MALLOC
+	m.bump = region_bump;
+#else
+	m.bump = NULL;
+#endif
+	return m;
+}
+
+void lfree_region(lregion_mark m)
+{
+	while (region != m.block)
+	{
+		lnursery_block* b = region;
+		region = b->next;
+#ifndef LALLOC_MALLOC
+		lnursery_give_block(b);
+#else
+		free(b);
+#endif
+	}
+#ifndef LALLOC_MALLOC
+	region_bump = m.bump;
+	region_end = region ? (char*)region + LNURSERY_BLOCK : NULL;
+#endif
+}
+
+lalloc_stats lalloc_get_stats(void)
+{
+	return stats;
+}
@@ -0,0 +1,89 @@
+#ifndef LALLOC_H
+#define LALLOC_H
+#include <stddef.h>
+
+/* Size-class slab allocator behind the lval constructors.
+ * Every thread keeps its own free list per size class, so the fast path
+ * is a pointer pop. Compile with -DLALLOC_MALLOC to send every request
+ * straight to malloc/free instead (for ASan and valgrind runs). */
+
+typedef struct lalloc_stats
+{
+	unsigned long allocs;
+	unsigned long reused;   /* served from a free list */
+	unsigned long carved;   /* bumped out of the current slab */
+	unsigned long slabs;    /* fresh slabs taken from malloc */
+	unsigned long large;    /* no size class fits, plain malloc */
+	unsigned long frees;
+	unsigned long young;    /* bump allocated in the nursery */
+	unsigned long blocks;   /* nursery blocks taken from the system */
+} lalloc_stats;
+
+void* lalloc(size_t size);
+
+void lfree(void* p, size_t size);
+
+/* Nursery for short-lived objects.
+ * Allocation bumps a pointer through the current 64K block. Each block
+ * counts its live objects and is reused as soon as the count drops back
+ * to zero, so temporaries are never handed to the free lists. Objects
+ * that must outlive the evaluation are copied out with lalloc (see
+ * lval_promote). */
+void* lalloc_young(size_t size);
+
+void lfree_young(void* p);
+
+/* Regions for arena mode (see lval_region_begin).
+ * Allocation bumps through blocks like the nursery, but nothing is freed
+ * on its own: releasing back to a mark frees everything allocated since
+ * in one go. Marks must be released in reverse order. */
+typedef struct lregion_mark
+{
+	void* block;
+	char* bump;
+} lregion_mark;
+
+void* lalloc_region(size_t size);
+
+lregion_mark lalloc_region_mark(void);
+
+void lfree_region(lregion_mark m);
+
+lalloc_stats lalloc_get_stats(void);
+
+/* Live memory held by values, environments and their buffers. Once the
+ * limit is exceeded evaluation stops with an error (see lval_eval) until
+ * enough is released again. */
+typedef struct lmem_stats
+{
+	size_t bytes;
+	size_t objects;
+	size_t peak;
+	size_t limit;   /* 0 for no limit */
+} lmem_stats;
+
+extern _Thread_local lmem_stats lmem;
+
+static inline void lmem_count(long bytes, long objects)
+{
+	lmem.bytes += bytes;
+	lmem.objects += objects;
+	if (lmem.bytes > lmem.peak) lmem.peak = lmem.bytes;
+}
+
+static inline int lmem_over(void)
+{
+	return lmem.limit && lmem.bytes > lmem.limit;
+}
+
+/* Reference counts. A count that another thread can read is only ever
+ * changed by the thread owning the value, so updates are an atomic store
+ * rather than a locked add. Dropping a reference is a release: a reader
+ * finding the count at one (LREF_UNIQUE, see lreap.c) also sees every
+ * reference taken to the parts before it. */
+#define LREF_INC(r) __atomic_store_n(&(r), (r) + 1, __ATOMIC_RELAXED)
+#define LREF_DEC(r) ({ __typeof__(r) lref_n = (r) - 1; \
+	__atomic_store_n(&(r), lref_n, __ATOMIC_RELEASE); lref_n; })
+#define LREF_UNIQUE(r) (__atomic_load_n(&(r), __ATOMIC_ACQUIRE) == 1)
+
+#endif
@@ -1,86 +1,365 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 
 #include "lval.h"
 #include "lenv.h"
+#include "lgc.h"
+#include "lalloc.h"
+#include "lintern.h"
+
+/* Global lookups are cached in the symbol that did the lookup. Scoping
+ * is dynamic, so any environment in the chain could bind the name too;
+ * every interned name counts its bindings outside the global
+ * environment, and a cache is only used while that count is zero. The
+ * version changes whenever global bindings move to other slots. */
+static lenv* lenv_global;
+static unsigned int lenv_version = 1;
+
+/* A binding of sym is added to (d = 1) or removed from (d = -1) e */
+static void lenv_shadow(lenv* e, char* sym, int d)
+{
+	if (e != lenv_global) lsym_of(sym)->shadows += d;
+}
+
+/* Smallest table, enough for most function calls */
+#define LENV_MIN_CAP (4)
+
+/* Interned names are unique, so the address is the key */
+static unsigned int lenv_hash(const char* sym)
+{
+	uintptr_t h = (uintptr_t)sym >> 3;
+	h ^= h >> 16;
+	return (unsigned int)(h * 0x9e3779b1u);
+}
+
+/* Tables up to this size are scanned in order instead of hashed. Calls
+ * bind a few names, and lookups pass through every frame on the way to
+ * the globals, so these are the common case. */
+#define LENV_SCAN_CAP (8)
+
+/* The slot holding sym, or the free slot where it belongs */
+static lenv_slot* lenv_find(lenv* e, const char* sym)
+{
+	/* Small tables fill up from the front */
+	if (e->cap <= LENV_SCAN_CAP)
+	{
+		lenv_slot* s = e->slots;
+		while (s->sym && s->sym != sym) s++;
+		return s;
+	}
+
+	unsigned int mask = e->cap - 1;
+	unsigned int i = lenv_hash(sym) & mask;
+	while (e->slots[i].sym && e->slots[i].sym != sym)
+	{
+		i = (i + 1) & mask;
+	}
+	return &e->slots[i];
+}
+
+/* An empty table of cap slots, not shared yet */
+static lenv_slot* lenv_slots_new(int cap)
+{
+	lenv_tab* t = calloc(1, sizeof(lenv_tab) + sizeof(lenv_slot) * cap);
+	lmem_count(sizeof(lenv_tab) + sizeof(lenv_slot) * cap, 0);
+	lgc_account(sizeof(lenv_tab) + sizeof(lenv_slot) * cap);
+	t->refs = 1;
+	return t->slots;
+}
+
+static void lenv_slots_free(lenv_slot* s, int cap)
+{
+	if (!s) return;
+	lmem_count(-(long)(sizeof(lenv_tab) + sizeof(lenv_slot) * cap), 0);
+	free(lenv_tab_of(s));
+}
+
+static void lenv_grow(lenv* e)
+{
+	lenv_slot* old = e->slots;
+	int cap = e->cap;
+
+	e->cap = cap ? cap * 2 : LENV_MIN_CAP;
+	e->slots = lenv_slots_new(e->cap);
+	for (int i = 0; i < cap; i++)
+	{
+		if (old[i].sym) *lenv_find(e, old[i].sym) = old[i];
+	}
+	lenv_slots_free(old, cap);
+	if (e == lenv_global) lenv_version++;
+}
 
 lenv* lenv_new(void)
 {
 	lenv* e = malloc(sizeof(lenv));
+	lmem_count(sizeof(lenv), 1);
 	e->par = NULL;
+	e->mark = 0;
+	e->refs = 1;
 	e->count = 0;
-	e->sym = NULL;
-	e->vals = NULL;
+	e->cap = 0;
+	e->slots = NULL;
+	if (lgc_on) lgc_track_env(e);
 	return e;
 }
 
 void lenv_del(lenv* e)
 {
-	for (int i = 0; i < e->count; ++i)
+	/* Collected environments are swept */
+	if (lgc_on || LREF_DEC(e->refs)) return;
+
+	/* The values go with the last reference to the table */
+	if (e->slots && lenv_tab_of(e->slots)->refs == 1)
+	{
+		for (int i = 0; i < e->cap; ++i)
+		{
+			if (e->slots[i].sym) lval_del(e->slots[i].val);
+		}
+	}
+	lenv_free(e);
+}
+
+/* Releases the environment itself, not the values bound in it */
+void lenv_free(lenv* e)
+{
+	if (e->slots && !LREF_DEC(lenv_tab_of(e->slots)->refs))
 	{
-		free(e->sym[i]);
-		lval_del(e->vals[i]);
+		for (int i = 0; i < e->cap; i++)
+		{
+			if (e->slots[i].sym) lenv_shadow(e, e->slots[i].sym, -1);
+		}
+		lenv_slots_free(e->slots, e->cap);
 	}
-	free(e->sym);
-	free(e->vals);
+	if (e == lenv_global)
+	{
+		lenv_global = NULL;
+		lenv_version++;
+	}
+	lmem_count(-(long)sizeof(lenv), -1);
 	free(e);
 }
 
 lenv* lenv_copy(lenv* e)
 {
-	lenv* n = malloc(sizeof(lenv));
+	lenv* n = lenv_new();
 	n->par = e->par;
 	n->count = e->count;
-	n->sym = malloc(sizeof(char*) * n->count);
-	n->vals = malloc(sizeof(lval*) * n->count);
-	for (int i = 0; i < e->count; i++)
+	n->cap = e->cap;
+	n->slots = e->slots;
+	if (n->slots) LREF_INC(lenv_tab_of(n->slots)->refs);
+	return n;
+}
+
+void lenv_own_slots(lenv* e)
+{
+	if (!e->slots || lenv_tab_of(e->slots)->refs == 1) return;
+
+	lenv_slot* s = lenv_slots_new(e->cap);
+	memcpy(s, e->slots, sizeof(lenv_slot) * e->cap);
+	for (int i = 0; i < e->cap; i++)
 	{
-		n->sym[i] = malloc(strlen(e->sym[i]) + 1);
-		strcpy(n->sym[i], e->sym[i]);
-		n->vals[i] = lval_copy(e->vals[i]);
+		if (!s[i].sym) continue;
+		s[i].val = lval_copy(s[i].val);
+		lenv_shadow(e, s[i].sym, 1);
 	}
+	LREF_DEC(lenv_tab_of(e->slots)->refs);
+	e->slots = s;
+}
+
+lenv* lenv_share(lenv* e)
+{
+	/* Not lowered under the collector, see LGC_SHARED */
+	if (lgc_on)
+	{
+		e->refs = LGC_SHARED;
+	}
+	else
+	{
+		LREF_INC(e->refs);
+	}
+	return e;
+}
+
+lenv* lenv_own(lenv* e)
+{
+	if (e->refs == 1) return e;
+
+	lenv* n = lenv_copy(e);
+	if (!lgc_on) LREF_DEC(e->refs);
 	return n;
 }
 
+int lenv_index(lenv* e, char* sym)
+{
+	if (!e->count) return -1;
+	lenv_slot* s = lenv_find(e, sym);
+	return s->sym ? (int)(s - e->slots) : -1;
+}
+
 lval* lenv_get(lenv* e, lval* k)
 {
-	for (int i = 0; i < e->count; ++i)
+	/* Resolved when the lambda was made, see builtin_lambda */
+	if (k->slot >= 0 && k->slot < e->cap && e->slots[k->slot].sym == k->sym)
 	{
-		if (!strcmp(e->sym[i], k->sym))
+		return lval_copy(e->slots[k->slot].val);
+	}
+
+	if (k->version == lenv_version && !lsym_of(k->sym)->shadows)
+	{
+		return lval_copy(lenv_global->slots[k->global].val);
+	}
+
+	for (; e; e = e->par)
+	{
+		if (e->cap <= LENV_SCAN_CAP)
+		{
+			for (int i = 0; i < e->count; i++)
+			{
+				if (e->slots[i].sym == k->sym) return lval_copy(e->slots[i].val);
+			}
+			continue;
+		}
+		lenv_slot* s = lenv_find(e, k->sym);
+		if (!s->sym) continue;
+		if (e == lenv_global)
 		{
-			return lval_copy(e->vals[i]);
+			k->global = s - e->slots;
+			k->version = lenv_version;
 		}
+		return lval_copy(s->val);
+	}
+	return lval_err(LERR_UNBOUND, k->sym);
+}
+
+void lenv_put(lenv* e, lval* k, lval* v)
+{
+	/* Top-level bindings survive the evaluation, move them out of the
+	 * nursery. Function environments always have a parent here. */
+	v = e->par ? lval_copy(v) : lval_promote(v);
+
+	lenv_own_slots(e);
+	if (2 * (e->count + 1) > e->cap)
+	{
+		lenv_grow(e);
 	}
 
-	if (e->par)
+	lenv_slot* s = lenv_find(e, k->sym);
+	if (s->sym)
 	{
-		return lenv_get(e->par, k);
+		lval_del(s->val);
 	}
 	else
 	{
-		return lval_err("Unbound Symbol '%s'", k->sym);
+		s->sym = k->sym;
+		e->count++;
+		lenv_shadow(e, k->sym, 1);
 	}
+	s->val = v;
 }
 
-void lenv_put(lenv* e, lval* k, lval* v)
+/* Call frames, one per depth of the call stack. They are reused from
+ * call to call with their slot tables, and only rebuilt when a call
+ * needs a table of another size. Frames deeper than LENV_KEEP_FRAMES
+ * are freed as the stack unwinds, and idle frames are not counted as
+ * live memory. */
+#define LENV_KEEP_FRAMES 32
+
+static lenv** lenv_frames;
+static int lenv_maxframes;  /* room in lenv_frames */
+static int lenv_nframes;    /* allocated */
+static int lenv_depth;      /* in use */
+
+static long lenv_frame_size(lenv* f)
+{
+	return sizeof(lenv) + sizeof(lenv_tab) + sizeof(lenv_slot) * f->cap;
+}
+
+lenv* lenv_push_frame(lenv* par, int n)
 {
-	for (int i = 0; i < e->count; ++i)
+	int cap = LENV_MIN_CAP;
+	while (2 * n > cap) cap *= 2;
+
+	lenv* f;
+	if (lenv_depth == lenv_nframes)
 	{
-		if ((!strcmp(e->sym[i], k->sym)))
+		if (lenv_nframes == lenv_maxframes)
 		{
-			lval_del(e->vals[i]);
-			e->vals[i] = lval_copy(v);
-			return;
+			lenv_maxframes = lenv_maxframes ? lenv_maxframes * 2 : LENV_KEEP_FRAMES;
+			lenv_frames = realloc(lenv_frames, sizeof(lenv*) * lenv_maxframes);
 		}
+		f = malloc(sizeof(lenv));
+		lmem_count(sizeof(lenv), 1);
+		f->mark = 0;
+		f->refs = 1;
+		f->count = 0;
+		f->cap = 0;
+		f->slots = NULL;
+		lenv_frames[lenv_nframes++] = f;
+	}
+	else
+	{
+		f = lenv_frames[lenv_depth];
+		lmem_count(lenv_frame_size(f), 1);
+	}
+	lenv_depth++;
+
+	if (f->cap != cap)
+	{
+		lenv_slots_free(f->slots, f->cap);
+		f->slots = lenv_slots_new(cap);
+		f->cap = cap;
 	}
+	f->par = par;
+	return f;
+}
 
-	e->count++;
-	e->vals = realloc(e->vals, sizeof(lval*) * e->count);
-	e->sym = realloc(e->sym, sizeof(char*) * e->count);
-	e->vals[e->count - 1] = lval_copy(v);
-	e->sym[e->count - 1] = malloc(strlen(k->sym) + 1);
-	strcpy(e->sym[e->count - 1], k->sym);
+void lenv_pop_frame(void)
+{
+	lenv* f = lenv_frames[--lenv_depth];
+	for (int i = 0; f->count; i++)
+	{
+		lenv_slot* s = &f->slots[i];
+		if (!s->sym) continue;
+		lenv_shadow(f, s->sym, -1);
+		lval_del(s->val);
+		s->sym = NULL;
+		f->count--;
+	}
+	f->par = NULL;
+
+	/* Frames above it went first, so it is always the last one */
+	if (lenv_depth >= LENV_KEEP_FRAMES)
+	{
+		lenv_slots_free(f->slots, f->cap);
+		lmem_count(-(long)sizeof(lenv), -1);
+		free(f);
+		lenv_nframes = lenv_depth;
+	}
+	else
+	{
+		lmem_count(-lenv_frame_size(f), -1);
+	}
+}
+
+void lenv_unmark_frames(void)
+{
+	for (int i = 0; i < lenv_nframes; i++)
+	{
+		lenv_frames[i]->mark = 0;
+	}
+}
+
+void lenv_make_global(lenv* e)
+{
+	if (lenv_global) return;
+	for (int i = 0; i < e->cap; i++)
+	{
+		if (e->slots[i].sym) lenv_shadow(e, e->slots[i].sym, -1);
+	}
+	lenv_global = e;
+	lenv_version++;
 }
 
 void lenv_def(lenv* e, lval* k, lval* v)
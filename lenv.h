@@ -1,5 +1,6 @@
 #ifndef LENV_H
 #define LENV_H
+#include <stddef.h>
 
 struct lval;
 struct lenv;
@@ -7,24 +8,80 @@ typedef struct lval lval;
 typedef struct lenv lenv;
 
 
+/* Bindings are keyed by interned symbol names, compared by pointer.
+ * A function environment is shared by every copy of the function, it is
+ * only copied when a call needs to bind into it (lenv_own). */
+typedef struct lenv_slot
+{
+	char* sym;    /* NULL for a free slot */
+	lval* val;
+} lenv_slot;
+
+/* slots is an open addressing table of cap entries (a power of two),
+ * kept at most half full. Bindings are never removed. Copies of an
+ * environment share the table until one of them binds a name. */
 struct lenv
 {
 	lenv* par;
+	int mark;
+	unsigned int refs;
 	int count;
-	char** sym;
-	lval** vals;
+	int cap;
+	lenv_slot* slots;
 };
 
+/* Header of a table, counting the environments that share it */
+typedef struct lenv_tab
+{
+	unsigned int refs;
+	lenv_slot slots[];
+} lenv_tab;
+
+static inline lenv_tab* lenv_tab_of(lenv_slot* slots)
+{
+	return (lenv_tab*)((char*)slots - offsetof(lenv_tab, slots));
+}
+
 lenv* lenv_new(void);
 
 void lenv_del(lenv* e);
 
+void lenv_free(lenv* e);
+
+/* A new environment sharing e's bindings, O(1) */
 lenv* lenv_copy(lenv* e);
 
+/* Gives e a table of its own before its slots are written to */
+void lenv_own_slots(lenv* e);
+
+/* Takes another reference to e */
+lenv* lenv_share(lenv* e);
+
+/* Returns an unshared version of e, consuming the given reference */
+lenv* lenv_own(lenv* e);
+
+/* Index of the slot binding sym in e itself, -1 if there is none */
+int lenv_index(lenv* e, char* sym);
+
 lval* lenv_get(lenv* e, lval* k);
 
 void lenv_put(lenv* e, lval* k, lval* v);
 
+/* Call frames. A call binds its arguments in a frame taken from a
+ * stack, sized for n bindings, instead of a new environment. Frames
+ * are popped in reverse order and owned by the stack, lenv_del and
+ * lenv_copy must not be used on them. */
+lenv* lenv_push_frame(lenv* par, int n);
+
+void lenv_pop_frame(void);
+
+/* Clears the collector's marks on the frames, they are not swept */
+void lenv_unmark_frames(void);
+
+/* Makes e the global environment, the bottom of every chain. Lookups
+ * that end in it are cached by the symbol looked up. */
+void lenv_make_global(lenv* e);
+
 void lenv_def(lenv* e, lval* k, lval* v);
 
 
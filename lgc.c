@@ -0,0 +1,223 @@
+#include <stdlib.h>
+
+#include "lval.h"
+#include "lenv.h"
+#include "lgc.h"
+#include "lalloc.h"
+
+int lgc_on = 0;
+
+static size_t lgc_heap;
+static size_t lgc_allocated;
+
+/* Everything the collector owns */
+static lval** lgc_vals;
+static int lgc_nvals, lgc_maxvals;
+static lenv** lgc_envs;
+static int lgc_nenvs, lgc_maxenvs;
+
+/* Root stack, environment and expression pairs */
+typedef struct lgc_root
+{
+	lenv* env;
+	lval* val;
+} lgc_root;
+
+static lgc_root* lgc_roots;
+static int lgc_nroots, lgc_maxroots;
+
+/* Values outside the registry that were marked, e.g. in arena regions,
+ * their marks are cleared after the sweep */
+static lval** lgc_young;
+static int lgc_nyoung, lgc_maxyoung;
+
+/* Pending work while marking, kept off the C stack */
+static lgc_root* lgc_work;
+static int lgc_nwork, lgc_maxwork;
+
+static void* lgc_grow(void* p, int* max, size_t size)
+{
+	*max = *max ? *max * 2 : 256;
+	return realloc(p, size * *max);
+}
+
+void lgc_enable(size_t heap)
+{
+	lgc_on = 1;
+	lgc_heap = heap;
+}
+
+void lgc_track(lval* v, size_t size)
+{
+	if (lgc_nvals == lgc_maxvals)
+	{
+		lgc_vals = lgc_grow(lgc_vals, &lgc_maxvals, sizeof(lval*));
+	}
+	lgc_vals[lgc_nvals++] = v;
+	lgc_allocated += size;
+}
+
+void lgc_track_env(lenv* e)
+{
+	if (lgc_nenvs == lgc_maxenvs)
+	{
+		lgc_envs = lgc_grow(lgc_envs, &lgc_maxenvs, sizeof(lenv*));
+	}
+	lgc_envs[lgc_nenvs++] = e;
+	lgc_allocated += sizeof(lenv);
+}
+
+void lgc_account(size_t bytes)
+{
+	if (lgc_on) lgc_allocated += bytes;
+}
+
+void lgc_push(lenv* e, lval* v)
+{
+	if (!lgc_on) return;
+
+	if (lgc_nroots == lgc_maxroots)
+	{
+		lgc_roots = lgc_grow(lgc_roots, &lgc_maxroots, sizeof(lgc_root));
+	}
+	lgc_roots[lgc_nroots].env = e;
+	lgc_roots[lgc_nroots].val = v;
+	lgc_nroots++;
+}
+
+void lgc_pop(void)
+{
+	if (!lgc_on) return;
+	lgc_nroots--;
+}
+
+static void lgc_mark_later(lenv* e, lval* v)
+{
+	if (lgc_nwork == lgc_maxwork)
+	{
+		lgc_work = lgc_grow(lgc_work, &lgc_maxwork, sizeof(lgc_root));
+	}
+	lgc_work[lgc_nwork].env = e;
+	lgc_work[lgc_nwork].val = v;
+	lgc_nwork++;
+}
+
+static void lgc_mark_val(lval* v)
+{
+	if (!v || lval_is_fixnum(v) || (v->flags & (LVAL_MARK | LVAL_STATIC)))
+	{
+		return;
+	}
+	v->flags |= LVAL_MARK;
+	if (v->flags & LVAL_YOUNG)
+	{
+		if (lgc_nyoung == lgc_maxyoung)
+		{
+			lgc_young = lgc_grow(lgc_young, &lgc_maxyoung, sizeof(lval*));
+		}
+		lgc_young[lgc_nyoung++] = v;
+	}
+
+	switch (v->type)
+	{
+	case LVAL_FUN:
+		if (!v->builtin)
+		{
+			lgc_mark_later(v->env, v->formals);
+			lgc_mark_later(NULL, v->body);
+		}
+		break;
+	case LVAL_SEXPR:
+	case LVAL_QEXPR:
+		for (int i = 0; i < v->count; i++)
+		{
+			lgc_mark_later(NULL, v->cell[i]);
+		}
+		break;
+	}
+}
+
+static void lgc_mark_env(lenv* e)
+{
+	if (!e || e->mark) return;
+	e->mark = 1;
+
+	lgc_mark_later(e->par, NULL);
+	for (int i = 0; i < e->cap; i++)
+	{
+		if (e->slots[i].sym) lgc_mark_later(NULL, e->slots[i].val);
+	}
+}
+
+static void lgc_mark(void)
+{
+	for (int i = 0; i < lgc_nroots; i++)
+	{
+		lgc_mark_later(lgc_roots[i].env, lgc_roots[i].val);
+	}
+
+	while (lgc_nwork)
+	{
+		lgc_root r = lgc_work[--lgc_nwork];
+		lgc_mark_env(r.env);
+		lgc_mark_val(r.val);
+	}
+}
+
+unsigned long lgc_collect(void)
+{
+	unsigned long freed = 0;
+	lgc_mark();
+
+	/* Sweep, compacting the survivors to the front */
+	int n = 0;
+	for (int i = 0; i < lgc_nvals; i++)
+	{
+		lval* v = lgc_vals[i];
+		if (v->flags & LVAL_MARK)
+		{
+			v->flags &= ~LVAL_MARK;
+			lgc_vals[n++] = v;
+		}
+		else
+		{
+			lval_free(v);
+			freed++;
+		}
+	}
+	lgc_nvals = n;
+
+	n = 0;
+	for (int i = 0; i < lgc_nenvs; i++)
+	{
+		lenv* e = lgc_envs[i];
+		if (e->mark)
+		{
+			e->mark = 0;
+			lgc_envs[n++] = e;
+		}
+		else
+		{
+			lenv_free(e);
+			freed++;
+		}
+	}
+	lgc_nenvs = n;
+
+	while (lgc_nyoung)
+	{
+		lgc_young[--lgc_nyoung]->flags &= ~LVAL_MARK;
+	}
+	lenv_unmark_frames();
+
+	lgc_allocated = 0;
+	return freed;
+}
+
+void lgc_maybe_collect(void)
+{
+	if (lgc_on && (lgc_allocated >= lgc_heap || lmem_over()))
+	{
+		lgc_collect();
+	}
+}
@@ -0,0 +1,52 @@
+#ifndef LGC_H
+#define LGC_H
+#include <stddef.h>
+
+struct lval;
+struct lenv;
+typedef struct lval lval;
+typedef struct lenv lenv;
+
+/* Opt-in tracing mark-and-sweep collector.
+ * When enabled every lval and lenv is registered with the collector and
+ * lval_del/lenv_del do nothing; memory is reclaimed by tracing from the
+ * root stack instead. The bottom root is the global environment, every
+ * S-Expression under evaluation pushes itself and its environment, a
+ * function being applied is pushed for the call, and the REPL and load
+ * root the forms they are working through.
+ * In arena mode lvals go in per-form regions instead of the registry,
+ * see lval_region_begin. */
+
+extern int lgc_on;
+
+/* Counts are never lowered while the collector is on. Taking a
+ * reference only records that a value is shared, the count sticks at
+ * LGC_SHARED so it cannot wrap and lval_own keeps copying it. */
+#define LGC_SHARED 2
+
+/* Must be called before anything is allocated. 'heap' is the number of
+ * bytes allocated between automatic collections, nodes and the memory
+ * they hold (see lgc_account). */
+void lgc_enable(size_t heap);
+
+void lgc_track(lval* v, size_t size);
+
+void lgc_track_env(lenv* e);
+
+/* Counts memory held outside the nodes, cell arrays, string buffers and
+ * environment tables, towards the next automatic collection */
+void lgc_account(size_t bytes);
+
+void lgc_push(lenv* e, lval* v);
+
+void lgc_pop(void);
+
+/* Collects if enough has been allocated or memory is over its limit.
+ * Only called where everything live is reachable from the roots: between
+ * top-level forms, and when an S-Expression starts evaluating. */
+void lgc_maybe_collect(void);
+
+/* Returns the number of objects freed */
+unsigned long lgc_collect(void);
+
+#endif
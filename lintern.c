@@ -0,0 +1,60 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "lintern.h"
+
+/* Open addressing with linear probing, kept at most half full */
+static char** lintern_tab;
+static unsigned long lintern_cap;
+static unsigned long lintern_count;
+
+static unsigned long lintern_hash(const char* s)
+{
+	/* FNV-1a */
+	unsigned long h = 2166136261u;
+	for (; *s; s++)
+	{
+		h = (h ^ (unsigned char)*s) * 16777619u;
+	}
+	return h;
+}
+
+static void lintern_grow(void)
+{
+	unsigned long cap = lintern_cap ? lintern_cap * 2 : 1024;
+	char** tab = calloc(cap, sizeof(char*));
+
+	for (unsigned long i = 0; i < lintern_cap; i++)
+	{
+		if (!lintern_tab[i]) continue;
+		unsigned long j = lintern_hash(lintern_tab[i]) & (cap - 1);
+		while (tab[j]) j = (j + 1) & (cap - 1);
+		tab[j] = lintern_tab[i];
+	}
+
+	free(lintern_tab);
+	lintern_tab = tab;
+	lintern_cap = cap;
+}
+
+char* lintern(const char* s)
+{
+	if (2 * (lintern_count + 1) > lintern_cap)
+	{
+		lintern_grow();
+	}
+
+	unsigned long i = lintern_hash(s) & (lintern_cap - 1);
+	while (lintern_tab[i])
+	{
+		if (!strcmp(lintern_tab[i], s)) return lintern_tab[i];
+		i = (i + 1) & (lintern_cap - 1);
+	}
+
+	lsym* n = malloc(sizeof(lsym) + strlen(s) + 1);
+	n->shadows = 0;
+	strcpy(n->name, s);
+	lintern_tab[i] = n->name;
+	lintern_count++;
+	return lintern_tab[i];
+}
@@ -0,0 +1,23 @@
+#ifndef LINTERN_H
+#define LINTERN_H
+
+#include <stddef.h>
+
+/* Process-wide symbol table.
+ * lintern returns the one copy of a name, so interned names can be
+ * compared by pointer. The copies live until the process exits. */
+char* lintern(const char* s);
+
+/* Each name is stored after a header with data kept per name */
+typedef struct lsym
+{
+	int shadows;   /* bindings outside the global environment, see lenv.c */
+	char name[];
+} lsym;
+
+static inline lsym* lsym_of(const char* s)
+{
+	return (lsym*)(s - offsetof(lsym, name));
+}
+
+#endif
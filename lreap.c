@@ -0,0 +1,265 @@
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "lval.h"
+#include "lenv.h"
+#include "lstr.h"
+#include "lalloc.h"
+#include "lreap.h"
+
+/* What the reaper hands back to the main thread */
+enum
+{
+	LREAP_SHELL,     /* released lval, free its memory (lval_free_shell) */
+	LREAP_VAL,       /* shared, drop the dead value's reference (lval_del) */
+	LREAP_CELLS,     /* shared cell array (lcells_release) */
+	LREAP_ENV,       /* shared environment (lenv_del) */
+	LREAP_ENV_FREE,  /* released environment (lenv_free) */
+	LREAP_STR        /* shared string buffer (lstr_release) */
+};
+
+typedef struct lreap_item
+{
+	int kind;
+	void* p;
+} lreap_item;
+
+typedef struct lreap_list
+{
+	lreap_item* items;
+	int count;
+	int max;
+} lreap_list;
+
+static void lreap_add(lreap_list* l, int kind, void* p)
+{
+	if (l->count == l->max)
+	{
+		l->max = l->max ? l->max * 2 : 256;
+		l->items = realloc(l->items, sizeof(lreap_item) * l->max);
+	}
+	l->items[l->count].kind = kind;
+	l->items[l->count].p = p;
+	l->count++;
+}
+
+static pthread_mutex_t lreap_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t lreap_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t lreap_idle = PTHREAD_COND_INITIALIZER;
+static int lreap_started;   /* 1 running, -1 could not start */
+static int lreap_busy;      /* working on a queue taken from lreap_todo */
+
+/* Dead values waiting for the reaper (LREAP_VAL items), and the work it
+ * handed back together with the memory it freed itself */
+static lreap_list lreap_todo;
+static lreap_list lreap_done;
+static long lreap_bytes, lreap_objects;
+
+/* A part of a dead value is freed here when it is unique, or handed
+ * back. A count only drops to one when the last other owner lets go, and
+ * nothing can take a new reference through the dead value, so one is a
+ * final answer while the main thread keeps changing the count. The
+ * acquire in LREF_UNIQUE makes the references that owner took to the
+ * parts visible before they are looked at. */
+static void lreap_part(lval* v, lreap_list* walk, lreap_list* done)
+{
+	if (!v || lval_is_fixnum(v) || (v->flags & LVAL_STATIC)) return;
+
+	if (LREF_UNIQUE(v->refs))
+	{
+		lreap_add(walk, LREAP_SHELL, v);
+	}
+	else
+	{
+		lreap_add(done, LREAP_VAL, v);
+	}
+}
+
+/* Frees what the dead value v owns, its own memory goes back to the
+ * main thread's allocator */
+static void lreap_one(lval* v, lreap_list* walk, lreap_list* done)
+{
+	switch (v->type)
+	{
+	case LVAL_STR:
+		if (v->flags & LVAL_INLINE) break;
+		if (lstr_unique(v->str))
+		{
+			lstr_release(v->str);
+		}
+		else
+		{
+			lreap_add(done, LREAP_STR, v->str);
+		}
+		break;
+	case LVAL_ERR:
+		if (v->err != LERR_CUSTOM) break;
+		if (lstr_unique(v->args[0].s))
+		{
+			lstr_release((char*)v->args[0].s);
+		}
+		else
+		{
+			lreap_add(done, LREAP_STR, (char*)v->args[0].s);
+		}
+		break;
+	case LVAL_FUN:
+		if (v->builtin) break;
+		if (LREF_UNIQUE(v->env->refs) && (!v->env->slots ||
+				LREF_UNIQUE(lenv_tab_of(v->env->slots)->refs)))
+		{
+			for (int i = 0; i < v->env->cap; i++)
+			{
+				lenv_slot* s = &v->env->slots[i];
+				if (s->sym) lreap_part(s->val, walk, done);
+			}
+			/* Freeing updates the counts kept per name, main thread */
+			lreap_add(done, LREAP_ENV_FREE, v->env);
+		}
+		else
+		{
+			lreap_add(done, LREAP_ENV, v->env);
+		}
+		lreap_part(v->formals, walk, done);
+		lreap_part(v->body, walk, done);
+		break;
+	case LVAL_SEXPR:
+	case LVAL_QEXPR:
+		{
+			lcells* b = lcells_of(v);
+			if (!b) break;
+			if (!LREF_UNIQUE(b->refs))
+			{
+				lreap_add(done, LREAP_CELLS, b);
+				break;
+			}
+			for (int i = 0; i < b->len; i++)
+			{
+				lreap_part(b->data[i], walk, done);
+			}
+			lmem_count(-(long)(sizeof(lcells) + sizeof(lval*) * b->cap), 0);
+			free(b);
+		}
+		break;
+	}
+	lreap_add(done, LREAP_SHELL, v);
+}
+
+static void* lreap_thread(void* unused)
+{
+	lreap_list todo = {0};
+	lreap_list walk = {0};
+	lreap_list done = {0};
+
+	pthread_mutex_lock(&lreap_lock);
+	while (1)
+	{
+		while (!lreap_todo.count)
+		{
+			pthread_cond_wait(&lreap_wake, &lreap_lock);
+		}
+
+		/* Take the whole queue and work on it unlocked */
+		lreap_list t = lreap_todo;
+		lreap_todo = todo;
+		todo = t;
+		lreap_busy = 1;
+		pthread_mutex_unlock(&lreap_lock);
+
+		for (int i = 0; i < todo.count; i++)
+		{
+			lreap_add(&walk, LREAP_SHELL, todo.items[i].p);
+			while (walk.count)
+			{
+				lreap_one(walk.items[--walk.count].p, &walk, &done);
+			}
+		}
+		todo.count = 0;
+
+		/* Memory freed here was counted against this thread, pass it on */
+		pthread_mutex_lock(&lreap_lock);
+		for (int i = 0; i < done.count; i++)
+		{
+			lreap_add(&lreap_done, done.items[i].kind, done.items[i].p);
+		}
+		done.count = 0;
+		lreap_bytes += (long)lmem.bytes;
+		lreap_objects += (long)lmem.objects;
+		lmem.bytes = 0;
+		lmem.objects = 0;
+		lreap_busy = 0;
+		pthread_cond_broadcast(&lreap_idle);
+	}
+	return NULL;
+}
+
+int lreap_give(lval* v)
+{
+	pthread_mutex_lock(&lreap_lock);
+	if (!lreap_started)
+	{
+		pthread_t t;
+		lreap_started = pthread_create(&t, NULL, lreap_thread, NULL) ? -1 : 1;
+		if (lreap_started > 0) pthread_detach(t);
+	}
+	if (lreap_started > 0)
+	{
+		lreap_add(&lreap_todo, LREAP_VAL, v);
+		pthread_cond_signal(&lreap_wake);
+	}
+	pthread_mutex_unlock(&lreap_lock);
+	return lreap_started > 0;
+}
+
+void lreap_wait(void)
+{
+	pthread_mutex_lock(&lreap_lock);
+	while (lreap_busy || lreap_todo.count)
+	{
+		pthread_cond_wait(&lreap_idle, &lreap_lock);
+	}
+	pthread_mutex_unlock(&lreap_lock);
+	lreap_drain();
+}
+
+void lreap_drain(void)
+{
+	static lreap_list done;
+
+	pthread_mutex_lock(&lreap_lock);
+	lreap_list t = lreap_done;
+	lreap_done = done;
+	done = t;
+	long bytes = lreap_bytes, objects = lreap_objects;
+	lreap_bytes = 0;
+	lreap_objects = 0;
+	pthread_mutex_unlock(&lreap_lock);
+
+	lmem_count(bytes, objects);
+	for (int i = 0; i < done.count; i++)
+	{
+		void* p = done.items[i].p;
+		switch (done.items[i].kind)
+		{
+		case LREAP_SHELL:
+			lval_free_shell(p);
+			break;
+		case LREAP_VAL:
+			lval_del(p);
+			break;
+		case LREAP_CELLS:
+			lcells_release(p);
+			break;
+		case LREAP_ENV:
+			lenv_del(p);
+			break;
+		case LREAP_ENV_FREE:
+			lenv_free(p);
+			break;
+		case LREAP_STR:
+			lstr_release(p);
+			break;
+		}
+	}
+	done.count = 0;
+}
@@ -0,0 +1,30 @@
+#ifndef LREAP_H
+#define LREAP_H
+
+struct lval;
+typedef struct lval lval;
+
+/* Background freeing of large dead values.
+ * With reference counting, dropping the last reference to a huge list
+ * frees every element on the spot. Instead lval_del hands such lists to
+ * a reaper thread. It frees everything only the dead list could reach;
+ * parts still shared with live values, and the lval memory owned by the
+ * allocator of the main thread, are handed back and finished by
+ * lreap_drain at the next safepoint. */
+
+/* Lists with at least this many cells are freed in the background */
+#define LREAP_MIN_CELLS (4096)
+
+/* v is dead (count zero), free it on the reaper thread. Returns 0 if
+ * there is no reaper and the caller has to free it. */
+int lreap_give(lval* v);
+
+/* Finishes what the reaper handed back. Main thread only, called where
+ * the collector would run: between top-level forms. */
+void lreap_drain(void);
+
+/* Waits for the reaper to finish everything given to it, then drains.
+ * Used when memory runs short and the reaper may hold the difference. */
+void lreap_wait(void);
+
+#endif
@@ -0,0 +1,73 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "lstr.h"
+#include "lalloc.h"
+#include "lgc.h"
+
+typedef struct lstr
+{
+	unsigned int refs;
+	unsigned int hash;   /* 0 until asked for */
+	size_t len;
+	char data[];
+} lstr;
+
+static lstr* lstr_of(const char* s)
+{
+	return (lstr*)(s - offsetof(lstr, data));
+}
+
+char* lstr_new(const char* s, size_t len)
+{
+	lstr* b = malloc(sizeof(lstr) + len + 1);
+	lmem_count(sizeof(lstr) + len + 1, 0);
+	lgc_account(sizeof(lstr) + len + 1);
+	b->refs = 1;
+	b->hash = 0;
+	b->len = len;
+	memcpy(b->data, s, len);
+	b->data[len] = '\0';
+	return b->data;
+}
+
+char* lstr_share(char* s)
+{
+	LREF_INC(lstr_of(s)->refs);
+	return s;
+}
+
+void lstr_release(char* s)
+{
+	lstr* b = lstr_of(s);
+	if (LREF_DEC(b->refs)) return;
+	lmem_count(-(long)(sizeof(lstr) + b->len + 1), 0);
+	free(b);
+}
+
+size_t lstr_len(const char* s)
+{
+	return lstr_of(s)->len;
+}
+
+int lstr_unique(const char* s)
+{
+	return LREF_UNIQUE(lstr_of(s)->refs);
+}
+
+unsigned int lstr_hash_bytes(const char* s, size_t len)
+{
+	unsigned int h = 2166136261u;
+	for (size_t i = 0; i < len; i++)
+	{
+		h = (h ^ (unsigned char)s[i]) * 16777619u;
+	}
+	return h ? h : 1;
+}
+
+unsigned int lstr_hash(const char* s)
+{
+	lstr* b = lstr_of(s);
+	if (!b->hash) b->hash = lstr_hash_bytes(s, b->len);
+	return b->hash;
+}
@@ -0,0 +1,27 @@
+#ifndef LSTR_H
+#define LSTR_H
+#include <stddef.h>
+
+/* Immutable reference counted string buffers.
+ * Strings are handled as plain char pointers to the text, the length
+ * and count sit in a header just before it. Copies share the buffer. */
+
+char* lstr_new(const char* s, size_t len);
+
+char* lstr_share(char* s);
+
+void lstr_release(char* s);
+
+size_t lstr_len(const char* s);
+
+/* Whether s holds the only reference to its buffer. Safe to ask from
+ * another thread: a count of one can't change under it. */
+int lstr_unique(const char* s);
+
+/* FNV-1a of len bytes of s, never 0 */
+unsigned int lstr_hash_bytes(const char* s, size_t len);
+
+/* Hash of the text, computed once and kept in the header */
+unsigned int lstr_hash(const char* s);
+
+#endif
@@ -4,52 +4,316 @@
 
 #include "lval.h"
 #include "lenv.h"
+#include "lalloc.h"
+#include "lgc.h"
+#include "lintern.h"
+#include "lstr.h"
+#include "lreap.h"
+
+/* Long-lived values, and everything while the collector is on */
+static lval* lval_alloc_old(int type, size_t size)
+{
+	lval* v = lalloc(size);
+	lmem_count(size, 1);
+	v->type = type;
+	v->flags = 0;
+	v->refs = 1;
+	if (lgc_on) lgc_track(v, size);
+	return v;
+}
+
+/* Arena mode, values of the form being evaluated go in its region */
+static int lval_arena;
+
+/* Region values holding memory of their own, released with the region */
+static lval** lval_fin;
+static int lval_nfin, lval_maxfin;
+
+/* Allocated in regions so far, given back when they are released */
+static size_t lval_region_bytes, lval_region_objects;
+
+static lval* lval_alloc_region(int type, size_t size)
+{
+	lval* v = lalloc_region(size);
+	lmem_count(size, 1);
+	lval_region_bytes += size;
+	lval_region_objects++;
+	v->type = type;
+	v->flags = LVAL_YOUNG;
+	v->refs = 1;
+
+	if (type != LVAL_NUM && type != LVAL_SYM && type != LVAL_FUN)
+	{
+		if (lval_nfin == lval_maxfin)
+		{
+			lval_maxfin = lval_maxfin ? lval_maxfin * 2 : 256;
+			lval_fin = realloc(lval_fin, sizeof(lval*) * lval_maxfin);
+		}
+		lval_fin[lval_nfin++] = v;
+	}
+	return v;
+}
+
+/* New values start in the nursery */
+static lval* lval_alloc(int type, size_t size)
+{
+	if (lgc_on)
+	{
+		if (lval_arena) return lval_alloc_region(type, size);
+		return lval_alloc_old(type, size);
+	}
+
+	lval* v = lalloc_young(size);
+	lmem_count(size, 1);
+	v->type = type;
+	v->flags = LVAL_YOUNG;
+	v->refs = 1;
+	return v;
+}
+
+/* Allocated size of a value, only its own member is stored */
+static size_t lval_size(lval* v)
+{
+	switch (v->type)
+	{
+	case LVAL_NUM:
+		return LVAL_SIZE(num);
+	case LVAL_ERR:
+		return LVAL_SIZE(args);
+	case LVAL_SYM:
+		return LVAL_SIZE(version);
+	case LVAL_STR:
+		if (v->flags & LVAL_INLINE) return LVAL_SIZE(str) + strlen(v->str) + 1;
+		return LVAL_SIZE(str);
+	case LVAL_FUN:
+		return v->builtin ? LVAL_SIZE(builtin) : LVAL_SIZE(body);
+	default:
+		return LVAL_SIZE(cell);
+	}
+}
+
+/* Growable stack used to walk deep values without recursing, so the
+ * depth of a value is only limited by memory */
+typedef struct lstack
+{
+	void** items;
+	int count;
+	int max;
+} lstack;
+
+static void lstack_push(lstack* s, void* p)
+{
+	if (s->count == s->max)
+	{
+		s->max = s->max ? s->max * 2 : 256;
+		s->items = realloc(s->items, sizeof(void*) * s->max);
+	}
+	s->items[s->count++] = p;
+}
+
+static void* lstack_pop(lstack* s)
+{
+	return s->items[--s->count];
+}
+
+static lcells* lcells_new(int cap)
+{
+	lcells* b = malloc(sizeof(lcells) + sizeof(lval*) * cap);
+	lmem_count(sizeof(lcells) + sizeof(lval*) * cap, 0);
+	lgc_account(sizeof(lcells) + sizeof(lval*) * cap);
+	b->refs = 1;
+	b->len = 0;
+	b->cap = cap;
+	return b;
+}
+
+void lcells_release(lcells* b)
+{
+	if (!b || LREF_DEC(b->refs)) return;
+	for (int i = 0; i < b->len; i++)
+	{
+		if (b->data[i]) lval_del(b->data[i]);
+	}
+	lmem_count(-(long)(sizeof(lcells) + sizeof(lval*) * b->cap), 0);
+	free(b);
+}
 
 lval* lval_num(long x)
 {
-	lval* v = malloc(sizeof(lval));
-	v->type = LVAL_NUM;
+	if (x >= LVAL_FIXNUM_MIN && x <= LVAL_FIXNUM_MAX)
+	{
+		return (lval*)(((uintptr_t)x << 1) | 1);
+	}
+
+	lval* v = lval_alloc(LVAL_NUM, LVAL_SIZE(num));
 	v->num = x;
 	return v;
 }
 
-lval* lval_err(char* fmt, ...)
+/* Message templates, indexed by error code */
+static const char* lerr_fmt[LERR_COUNT] =
 {
-	lval* v = malloc(sizeof(lval));
-	v->type = LVAL_ERR;
-	/* initialize vararg list for initialization*/
+	[LERR_CUSTOM] = "%s",
+	[LERR_DIV_ZERO] = "Division by zero!!",
+	[LERR_BAD_NUMBER] = "Invalid number",
+	[LERR_UNBOUND] = "Unbound Symbol '%s'",
+	[LERR_ARG_TYPE] = "Function '%s' passed incorrect type for argument %i, "
+		"Got %s, Expected %s.",
+	[LERR_ARG_COUNT] = "Function '%s' passed incorrect number of arguments. "
+		"Got %i, Expected %i.",
+	[LERR_ARG_EMPTY] = "Function '%s' passed {} for argument %i.",
+	[LERR_NOT_SYMBOL] = "Cannot define non-symbol. Got %s, Expected %s.",
+	[LERR_DEF_NOT_SYMBOL] = "Function '%s' cannot define non-symbol. "
+		"Got %s, Expected %s.",
+	[LERR_DEF_COUNT] = "Function '%s' passed too many arguments for symbols. "
+		"Got %i, Expected %i.",
+	[LERR_TOO_MANY_ARGS] = "Function passed too many arguments. "
+		"Got %i, Expected %i.",
+	[LERR_BAD_FORMALS] = "Function format invalid. "
+		"Symbol '&' not followed by single symbol.",
+	[LERR_NOT_FUNCTION] = "S-Expression starts with incorrect type. "
+		"Got %s, Expected %s.",
+	[LERR_NO_GC] = "Garbage collector is not enabled. Start with --gc.",
+	[LERR_BAD_RANGE] = "Function '%s' passed range %i to %i, "
+		"list has %i elements.",
+	[LERR_MEM_LIMIT] = "Memory limit exceeded.",
+};
+
+/* Errors without arguments are preallocated and shared */
+static lval lerr_static[LERR_COUNT];
+
+lval* lval_err(int code, ...)
+{
+	const char* fmt = lerr_fmt[code];
+
+	if (!strchr(fmt, '%'))
+	{
+		lval* v = &lerr_static[code];
+		v->type = LVAL_ERR;
+		v->flags = LVAL_STATIC;
+		v->refs = 1;
+		v->err = code;
+		return v;
+	}
+
+	lval* v = lval_alloc(LVAL_ERR, LVAL_SIZE(args));
+	v->err = code;
+
+	/* Capture the arguments the template asks for, format nothing yet */
 	va_list va;
-	va_start(va, fmt);
-	v->err = malloc(MAX_ERR + 1);
-	vsnprintf(v->err, MAX_ERR, fmt, va);
-	/*realloc to actual used space */
-	v->err = realloc(v->err, strlen(v->err) + 1);
+	va_start(va, code);
+	int n = 0;
+	for (const char* c = fmt; *c; c++)
+	{
+		if (*c != '%') continue;
+		c++;
+		if (*c == 's')
+		{
+			v->args[n++].s = va_arg(va, const char*);
+		}
+		else
+		{
+			v->args[n++].i = va_arg(va, int);
+		}
+	}
 	va_end(va);
 	return v;
 }
 
+/* Error carrying its own text, takes over a reference to the lstr s */
+lval* lval_err_str(char* s)
+{
+	lval* v = lval_alloc(LVAL_ERR, LVAL_SIZE(args));
+	v->err = LERR_CUSTOM;
+	v->args[0].s = s;
+	return v;
+}
+
+/* Formats the message of error v into buf */
+void lval_err_msg(lval* v, char* buf, size_t size)
+{
+	size_t n = 0;
+	int arg = 0;
+
+	for (const char* c = lerr_fmt[v->err]; *c && n + 1 < size; c++)
+	{
+		if (*c != '%')
+		{
+			buf[n++] = *c;
+			continue;
+		}
+		c++;
+		if (*c == 's')
+		{
+			n += snprintf(buf + n, size - n, "%s", v->args[arg++].s);
+		}
+		else
+		{
+			n += snprintf(buf + n, size - n, "%li", v->args[arg++].i);
+		}
+	}
+
+	buf[n < size ? n : size - 1] = '\0';
+}
+
 lval* lval_sym(char* s)
 {
-	lval* v = malloc(sizeof(lval));
-	v->type = LVAL_SYM;
-	v->sym = malloc(strlen(s) + 1);
-	strcpy(v->sym, s);
+	lval* v = lval_alloc(LVAL_SYM, LVAL_SIZE(version));
+	/* Symbols are interned, equal names share one string */
+	v->sym = lintern(s);
+	v->slot = -1;
+	v->version = 0;
 	return v;
 }
 
 lval* lval_str(char* s)
 {
-	lval* v = malloc(sizeof(lval));
-	v->type = LVAL_STR;
-	v->str = malloc(strlen(s) + 1);
-	strcpy(v->str, s);
+	size_t len = strlen(s);
+
+	/* Short text goes right after the lval */
+	if (len <= LVAL_INLINE_MAX)
+	{
+		lval* v = lval_alloc(LVAL_STR, LVAL_SIZE(str) + len + 1);
+		v->flags |= LVAL_INLINE;
+		v->str = (char*)v + LVAL_SIZE(str);
+		memcpy(v->str, s, len + 1);
+		return v;
+	}
+
+	lval* v = lval_alloc(LVAL_STR, LVAL_SIZE(str));
+	v->str = lstr_new(s, len);
 	return v;
 }
 
+/* Gives x, allocated with the size of v, the text of v */
+static void lval_str_copy(lval* x, lval* v)
+{
+	if (v->flags & LVAL_INLINE)
+	{
+		x->flags |= LVAL_INLINE;
+		x->str = (char*)x + LVAL_SIZE(str);
+		strcpy(x->str, v->str);
+	}
+	else
+	{
+		x->str = lstr_share(v->str);
+	}
+}
+
+size_t lval_str_len(lval* v)
+{
+	return (v->flags & LVAL_INLINE) ? strlen(v->str) : lstr_len(v->str);
+}
+
+char* lval_str_share(lval* v)
+{
+	if (v->flags & LVAL_INLINE) return lstr_new(v->str, strlen(v->str));
+	return lstr_share(v->str);
+}
+
 lval* lval_builtin(lbuiltin fun)
 {
-	lval* v = malloc(sizeof(lval));
-	v->type = LVAL_FUN;
+	lval* v = lval_alloc(LVAL_FUN, LVAL_SIZE(builtin));
 	v->builtin = fun;
 	return v;
 }
@@ -58,8 +322,7 @@ lenv* lenv_new(void);
 
 lval* lval_lambda(lval* formals, lval* body)
 {
-	lval* v = malloc(sizeof(lval));
-	v->type = LVAL_FUN;
+	lval* v = lval_alloc(LVAL_FUN, LVAL_SIZE(body));
 
 	v->builtin = NULL;
 
@@ -74,60 +337,162 @@ lval* lval_lambda(lval* formals, lval* body)
 
 lval* lval_sexpr(void)
 {
-	lval* v = malloc(sizeof(lval));
-	v->type = LVAL_SEXPR;
+	lval* v = lval_alloc(LVAL_SEXPR, LVAL_SIZE(cell));
 	v->count = 0;
+	v->off = 0;
+	v->hash = 0;
 	v->cell = NULL;
 	return v;
 }
 
 lval* lval_qexpr(void)
 {
-	lval* v = malloc(sizeof(lval));
-	v->type = LVAL_QEXPR;
+	lval* v = lval_alloc(LVAL_QEXPR, LVAL_SIZE(cell));
 	v->count = 0;
+	v->off = 0;
+	v->hash = 0;
 	v->cell = NULL;
 	return v;
 }
 
+/* Huge lists are left to the reaper thread, see lreap.h */
+static int lval_reapable(lval* v)
+{
+	if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) return 0;
+	lcells* b = lcells_of(v);
+	return b && b->refs == 1 && b->len >= LREAP_MIN_CELLS;
+}
+
+/* Values whose last reference is gone, waiting to be freed by the
+ * outermost lval_del. Freeing them releases their children, which only
+ * adds to the stack instead of recursing. */
+static _Thread_local lstack lval_dead;
+static _Thread_local int lval_freeing;
+
 void lval_del(lval* v)
 {
-	switch (v->type)
+	/* Immediate numbers own no memory, collected values are swept */
+	if (lval_is_fixnum(v) || lgc_on || (v->flags & LVAL_STATIC)) return;
+
+	/* Only the last owner frees */
+	if (LREF_DEC(v->refs)) return;
+
+	lstack_push(&lval_dead, v);
+	if (lval_freeing) return;
+
+	lval_freeing = 1;
+	while (lval_dead.count)
 	{
-	case LVAL_NUM:
-		break;
-	case LVAL_FUN:
-		if (!v->builtin)
+		v = lstack_pop(&lval_dead);
+		if (lval_reapable(v) && lreap_give(v)) continue;
+		if (v->type == LVAL_FUN && !v->builtin)
 		{
 			lenv_del(v->env);
 			lval_del(v->formals);
 			lval_del(v->body);
 		}
-		break;
+		lval_free(v);
+	}
+	lval_freeing = 0;
+}
+
+/* Releases what v holds besides its own memory */
+static void lval_release(lval* v)
+{
+	switch (v->type)
+	{
 	case LVAL_STR:
-		free(v->str);
+		if (!(v->flags & LVAL_INLINE)) lstr_release(v->str);
 		break;
 	case LVAL_ERR:
-		free(v->err);
-		break;
-	case LVAL_SYM:
-		free(v->sym);
+		if (v->err == LERR_CUSTOM) lstr_release((char*)v->args[0].s);
 		break;
 	case LVAL_QEXPR:
 	case LVAL_SEXPR:
-		for (int i = 0; i< v->count; i++)
-			lval_del(v->cell[i]);
-		free(v->cell);
+		lcells_release(lcells_of(v));
 		break;
 	}
-	free(v);
 }
 
+/* Releases the memory of v itself, not of the values it refers to */
+void lval_free(lval* v)
+{
+	lval_release(v);
+	lval_free_shell(v);
+}
+
+void lval_free_shell(lval* v)
+{
+	size_t size = lval_size(v);
+	lmem_count(-(long)size, -1);
+
+	if (v->flags & LVAL_YOUNG)
+	{
+		lfree_young(v);
+	}
+	else
+	{
+		lfree(v, size);
+	}
+}
+
+void lval_arena_enable(void)
+{
+	lval_arena = 1;
+}
+
+lval_region lval_region_begin(void)
+{
+	lval_region r;
+	r.mark = lalloc_region_mark();
+	r.fin = lval_nfin;
+	r.bytes = lval_region_bytes;
+	r.objects = lval_region_objects;
+	return r;
+}
+
+void lval_region_end(lval_region r)
+{
+	if (!lval_arena) return;
+
+	while (lval_nfin > r.fin)
+	{
+		lval_release(lval_fin[--lval_nfin]);
+	}
+	lfree_region(r.mark);
+
+	lmem_count(-(long)(lval_region_bytes - r.bytes),
+			-(long)(lval_region_objects - r.objects));
+	lval_region_bytes = r.bytes;
+	lval_region_objects = r.objects;
+}
+
+/* Copying shares the value, it is only duplicated once someone needs
+ * to modify it (lval_own) */
 lval* lval_copy(lval* v)
 {
+	/* Statics are never freed, their count is left alone */
+	if (lval_is_fixnum(v) || (v->flags & LVAL_STATIC)) return v;
+	if (lgc_on)
+	{
+		v->refs = LGC_SHARED;
+	}
+	else
+	{
+		LREF_INC(v->refs);
+	}
+	return v;
+}
+
+/* Returns a version of v that is safe to mutate, consuming the given
+ * reference. A shared value is duplicated one level deep, its children
+ * stay shared. */
+lval* lval_own(lval* v)
+{
+	if (lval_is_fixnum(v)) return v;
+	if (v->refs == 1 && !(v->flags & LVAL_STATIC)) return v;
 
-	lval* x = malloc(sizeof(lval));
-	x->type = v->type;
+	lval* x = lval_alloc(v->type, lval_size(v));
 
 	switch (v->type)
 	{
@@ -141,7 +506,7 @@ lval* lval_copy(lval* v)
 		else
 		{
 			x->builtin = NULL;
-			x->env = lenv_copy(v->env);
+			x->env = lenv_share(v->env);
 			x->formals = lval_copy(v->formals);
 			x->body = lval_copy(v->body);
 		}
@@ -149,102 +514,512 @@ lval* lval_copy(lval* v)
 	case LVAL_NUM:
 		x->num = v->num;
 		break;
-		/* Copy Strings using malloc and strcpy */
+		/* Strings are immutable, share the text */
 	case LVAL_STR:
-		x->str = malloc(strlen(v->str) + 1);
-		strcpy(x->str, v->str);
+		lval_str_copy(x, v);
 		break;
 	case LVAL_ERR:
-		x->err = malloc(strlen(v->err) + 1);
-		strcpy(x->err, v->err);
+		x->err = v->err;
+		memcpy(x->args, v->args, sizeof(v->args));
+		if (x->err == LERR_CUSTOM) lstr_share((char*)x->args[0].s);
 		break;
 
 	case LVAL_SYM:
-		x->sym = malloc(strlen(v->sym) + 1);
-		strcpy(x->sym, v->sym);
+		x->sym = v->sym;
+		x->slot = v->slot;
+		x->global = v->global;
+		x->version = v->version;
 		break;
 
-		/* Copy Lists by copying each sub-expression */
+		/* Copy Lists by sharing the cell array */
 	case LVAL_SEXPR:
 	case LVAL_QEXPR:
 		x->count = v->count;
-		x->cell = malloc(sizeof(lval*) * x->count);
-		for (int i = 0; i < x->count; i++)
+		x->off = v->off;
+		x->hash = v->hash;
+		x->cell = v->cell;
+		if (x->cell) LREF_INC(lcells_of(x)->refs);
+		break;
+	}
+	if (!lgc_on && !(v->flags & LVAL_STATIC)) LREF_DEC(v->refs);
+	return x;
+}
+
+/* Copies v out of the nursery. Its children are shared for now, the
+ * slots holding them are left on 'todo' to be promoted in turn. */
+static lval* lval_promote_one(lval* v, lstack* todo)
+{
+	if (lval_is_fixnum(v) || !(v->flags & LVAL_YOUNG)) return lval_copy(v);
+
+	lval* x = lval_alloc_old(v->type, lval_size(v));
+
+	switch (v->type)
+	{
+	case LVAL_FUN:
+		if (v->builtin)
 		{
-			x->cell[i] = lval_copy(v->cell[i]);
+			x->builtin = v->builtin;
+		}
+		else
+		{
+			x->builtin = NULL;
+			x->env = lenv_copy(v->env);
+			lenv_own_slots(x->env);
+			/* The parent is set again on every call, don't keep it reachable */
+			x->env->par = NULL;
+			for (int i = 0; i < x->env->cap; i++)
+			{
+				lenv_slot* s = &x->env->slots[i];
+				if (s->sym) lstack_push(todo, &s->val);
+			}
+			x->formals = lval_copy(v->formals);
+			x->body = lval_copy(v->body);
+			lstack_push(todo, &x->formals);
+			lstack_push(todo, &x->body);
 		}
 		break;
+	case LVAL_NUM:
+		x->num = v->num;
+		break;
+	case LVAL_STR:
+		lval_str_copy(x, v);
+		break;
+	case LVAL_ERR:
+		x->err = v->err;
+		memcpy(x->args, v->args, sizeof(v->args));
+		if (x->err == LERR_CUSTOM) lstr_share((char*)x->args[0].s);
+		break;
+	case LVAL_SYM:
+		x->sym = v->sym;
+		x->slot = v->slot;
+		x->global = v->global;
+		x->version = v->version;
+		break;
+	case LVAL_SEXPR:
+	case LVAL_QEXPR:
+		x->count = v->count;
+		x->off = 0;
+		x->hash = v->hash;
+		x->cell = NULL;
+		if (v->count)
+		{
+			lcells* b = lcells_new(v->count);
+			for (int i = 0; i < v->count; i++)
+			{
+				b->data[i] = lval_copy(v->cell[i]);
+				lstack_push(todo, &b->data[i]);
+			}
+			b->len = v->count;
+			x->cell = b->data;
+		}
+		break;
+	}
+	return x;
+}
+
+/* Returns a reference to v outside the nursery. A young value is
+ * copied out together with everything it refers to, so long-lived
+ * values never keep nursery blocks alive. */
+lval* lval_promote(lval* v)
+{
+	static _Thread_local lstack todo;
+
+	int base = todo.count;
+	lval* x = lval_promote_one(v, &todo);
+	while (todo.count > base)
+	{
+		lval** slot = lstack_pop(&todo);
+		lval* old = *slot;
+		*slot = lval_promote_one(old, &todo);
+		lval_del(old);
 	}
 	return x;
 }
 
+/* Hash-consed literals, open addressing on lval_hash */
+static int lval_consing;
+static lval** lval_conses;
+static int lval_nconses, lval_maxconses;
+
+void lval_hashcons_enable(void)
+{
+	lval_consing = 1;
+}
+
+/* A never-freed copy of v alone. Its cells still point into v, the
+ * slots holding them are left on 'todo' to be made static in turn. */
+static lval* lval_static_one(lval* v, lstack* todo)
+{
+	if (lval_is_fixnum(v) || (v->flags & LVAL_STATIC)) return lval_copy(v);
+
+	size_t size = lval_size(v);
+	lval* x = lalloc(size);
+	lmem_count(size, 1);
+	x->type = v->type;
+	x->flags = LVAL_STATIC;
+	x->refs = 2;
+
+	/* The reader only makes numbers, symbols, strings and lists */
+	switch (v->type)
+	{
+	case LVAL_NUM:
+		x->num = v->num;
+		break;
+	case LVAL_SYM:
+		x->sym = v->sym;
+		x->slot = v->slot;
+		x->global = v->global;
+		x->version = v->version;
+		break;
+	case LVAL_STR:
+		lval_str_copy(x, v);
+		break;
+	case LVAL_SEXPR:
+	case LVAL_QEXPR:
+		x->count = v->count;
+		x->off = 0;
+		x->hash = v->hash;
+		x->cell = NULL;
+		if (v->count)
+		{
+			lcells* b = lcells_new(v->count);
+			for (int i = 0; i < v->count; i++)
+			{
+				b->data[i] = v->cell[i];
+				lstack_push(todo, &b->data[i]);
+			}
+			b->len = v->count;
+			x->cell = b->data;
+		}
+		break;
+	}
+	return x;
+}
+
+/* A copy of v that is never freed. Copies don't touch its count and
+ * lval_own always duplicates it, so it is never mutated in place. */
+static lval* lval_static(lval* v)
+{
+	static _Thread_local lstack todo;
+
+	int base = todo.count;
+	lval* x = lval_static_one(v, &todo);
+	while (todo.count > base)
+	{
+		lval** slot = lstack_pop(&todo);
+		*slot = lval_static_one(*slot, &todo);
+	}
+	return x;
+}
+
+static void lval_conses_grow(void)
+{
+	int max = lval_maxconses ? lval_maxconses * 2 : 256;
+	lval** conses = calloc(max, sizeof(lval*));
+	for (int i = 0; i < lval_maxconses; i++)
+	{
+		lval* c = lval_conses[i];
+		if (!c) continue;
+		int j = c->hash & (max - 1);
+		while (conses[j]) j = (j + 1) & (max - 1);
+		conses[j] = c;
+	}
+	free(lval_conses);
+	lval_conses = conses;
+	lval_maxconses = max;
+}
+
+lval* lval_hashcons(lval* v)
+{
+	if (!lval_consing || lval_type(v) != LVAL_QEXPR) return v;
+
+	if (lval_nconses * 2 >= lval_maxconses) lval_conses_grow();
+
+	/* Nested literals were consed first, so comparing is shallow */
+	unsigned int h = lval_hash(v);
+	int i = h & (lval_maxconses - 1);
+	for (; lval_conses[i]; i = (i + 1) & (lval_maxconses - 1))
+	{
+		lval* c = lval_conses[i];
+		if (c->hash == h && lval_eq(c, v))
+		{
+			lval_del(v);
+			return lval_copy(c);
+		}
+	}
+
+	lval* c = lval_static(v);
+	c->flags |= LVAL_CONSED;
+	lval_conses[i] = c;
+	lval_nconses++;
+	lval_del(v);
+	return lval_copy(c);
+}
+
+/* Makes the cells of v private to it, so they can be overwritten and
+ * appended to. v itself must already be owned. */
+void lval_own_cells(lval* v)
+{
+	/* The cells are about to change */
+	v->hash = 0;
+
+	lcells* b = lcells_of(v);
+	if (!b) return;
+
+	if (b->refs == 1)
+	{
+		/* Drop what other views left outside of this one */
+		for (int i = 0; i < b->len; i++)
+		{
+			if (i == v->off) i += v->count;
+			if (i < b->len && b->data[i])
+			{
+				lval_del(b->data[i]);
+				b->data[i] = NULL;
+			}
+		}
+		b->len = v->off + v->count;
+		return;
+	}
+
+	lcells* n = lcells_new(v->count + 1);
+	for (int i = 0; i < v->count; i++)
+	{
+		n->data[i] = lval_copy(v->cell[i]);
+	}
+	n->len = v->count;
+	LREF_DEC(b->refs);
+	v->cell = n->data;
+	v->off = 0;
+}
+
+/* Makes room for n more cells at the end of v */
+static void lval_reserve(lval* v, int n)
+{
+	lval_own_cells(v);
+	lcells* b = lcells_of(v);
+
+	if (!b)
+	{
+		b = lcells_new(n > 4 ? n : 4);
+		v->cell = b->data;
+		v->off = 0;
+		return;
+	}
+
+	if (v->off + v->count + n <= b->cap) return;
+
+	/* Mostly popped from the front, reuse that space */
+	if (v->count + n <= v->off)
+	{
+		memmove(b->data, v->cell, sizeof(lval*) * v->count);
+		v->cell = b->data;
+		v->off = 0;
+		b->len = v->count;
+		return;
+	}
+
+	/* Otherwise grow geometrically */
+	int cap = b->cap * 2;
+	while (cap < v->off + v->count + n) cap *= 2;
+	lmem_count(sizeof(lval*) * (cap - b->cap), 0);
+	lgc_account(sizeof(lval*) * (cap - b->cap));
+	b = realloc(b, sizeof(lcells) + sizeof(lval*) * cap);
+	b->cap = cap;
+	v->cell = b->data + v->off;
+}
+
+lval* lval_sexpr_sized(int n)
+{
+	lval* v = lval_sexpr();
+	if (n) lval_reserve(v, n);
+	return v;
+}
+
 lval* lval_add(lval* v, lval* x)
 {
 	if (NULL == x) return v;
-	v->count++;
-	v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-	v->cell[v->count-1] = x;
+	v = lval_own(v);
+	lval_reserve(v, 1);
+	v->cell[v->count++] = x;
+	lcells_of(v)->len = v->off + v->count;
 	return v;
 }
 
+/* Moves the cells of v to dst when nothing else sees them, otherwise
+ * shares them */
+static void lval_give_cells(lval* v, lval** dst)
+{
+	if (v->refs == 1 && lcells_of(v)->refs == 1)
+	{
+		/* Leave the slots empty so they are not released with v */
+		memcpy(dst, v->cell, sizeof(lval*) * v->count);
+		memset(v->cell, 0, sizeof(lval*) * v->count);
+	}
+	else
+	{
+		for (int i = 0; i < v->count; i++)
+		{
+			dst[i] = lval_copy(v->cell[i]);
+		}
+	}
+}
+
+/* Joins a short x in front of y. Slots before y's view that hold
+ * nothing are not part of any view, x goes there and the result shares
+ * y's array. Otherwise y is moved to a new array with as much room in
+ * front as it holds, so lists built from the front grow in amortized
+ * constant time. */
+static lval* lval_prepend(lval* x, lval* y)
+{
+	int k = x->count;
+	int room = y->off >= k;
+	for (int i = 1; room && i <= k; i++)
+	{
+		if (y->cell[-i]) room = 0;
+	}
+
+	y = lval_own(y);
+	if (!room)
+	{
+		lcells* b = lcells_of(y);
+		int cap = 2 * (y->count + k);
+		int off = cap - y->count;
+		lcells* n = lcells_new(cap);
+		memset(n->data, 0, sizeof(lval*) * off);
+		lval_give_cells(y, &n->data[off]);
+		n->len = cap;
+		lcells_release(b);
+		y->cell = &n->data[off];
+		y->off = off;
+	}
+
+	y->cell -= k;
+	y->off -= k;
+	y->count += k;
+	if (k) lval_give_cells(x, y->cell);
+	y->type = x->type;
+	y->hash = 0;
+	lval_del(x);
+	return y;
+}
+
 lval* lval_join(lval* x, lval* y)
 {
-	/* Add each element of y to x */
-	for (int i = 0; i < y->count; ++i)
+	if (y->count == 0)
 	{
-		x = lval_add(x, y->cell[i]);
+		lval_del(y);
+		return x;
 	}
-	free(y->cell);
-	free(y);
+
+	if (x->count < y->count) return lval_prepend(x, y);
+
+	x = lval_own(x);
+	lval_reserve(x, y->count);
+
+	/* Add each element of y to x */
+	lval_give_cells(y, &x->cell[x->count]);
+	x->count += y->count;
+	lcells_of(x)->len = x->off + x->count;
+	lval_del(y);
 	return x;
 }
 
 lval* lval_pop(lval* v, int i)
 {
-	lval* x = v->cell[i];
-	memmove(&v->cell[i], &v->cell[i+1], sizeof(lval*) * (v->count - 1 - i));
+	/* Popping the front only moves the start of the view. If the
+	 * array is shared it keeps its reference and the rest of the list
+	 * is not copied, otherwise the slot is handed over. */
+	if (i == 0)
+	{
+		lval* x = v->cell[0];
+		if (lcells_of(v)->refs > 1)
+		{
+			x = lval_copy(x);
+		}
+		else
+		{
+			v->cell[0] = NULL;
+		}
+		v->cell++;
+		v->off++;
+		v->count--;
+		v->hash = 0;
+		return x;
+	}
 
+	lval_own_cells(v);
+	lval* x = v->cell[i];
 	v->count--;
-	v->cell = realloc(v->cell, sizeof(lval*) * v->count);
+	memmove(&v->cell[i], &v->cell[i+1], sizeof(lval*) * (v->count - i));
+	lcells_of(v)->len--;
 	return x;
 }
 
 lval* lval_take(lval* v, int i)
 {
+	/* A shared list is left intact, just share the element */
+	if (v->refs > 1)
+	{
+		lval* x = lval_copy(v->cell[i]);
+		lval_del(v);
+		return x;
+	}
+
 	lval* x = lval_pop(v, i);
 	lval_del(v);
 	return x;
 }
 
-void lval_print(lval* v);
+lval* lval_slice(lval* v, int start, int end)
+{
+	/* Only the view moves, cells left out stay with the array until it
+	 * is released or written to */
+	v = lval_own(v);
+	if (v->cell)
+	{
+		v->cell += start;
+		v->off += start;
+	}
+	v->count = end - start;
+	v->hash = 0;
+	return v;
+}
 
+/* Pending output of lval_print, pairs of a text and a value, one of
+ * them NULL. Lists push their cells instead of recursing. */
+static _Thread_local lstack lval_printing;
 
-void lval_print_expr(lval* v, char open, char close)
+static void lval_print_push(char* text, lval* v)
 {
-	putchar(open);
-	for (int i = 0; i < v->count; ++i)
+	lstack_push(&lval_printing, text);
+	lstack_push(&lval_printing, v);
+}
+
+/* Queues the cells of v separated by spaces, then the closing text */
+static void lval_print_cells(lval* v, char* close)
+{
+	lval_print_push(close, NULL);
+	for (int i = v->count - 1; i >= 0; i--)
 	{
-		lval_print(v->cell[i]);
-		if (i != (v->count - 1))
-		{
-			putchar(' ');
-		}
+		lval_print_push(NULL, v->cell[i]);
+		if (i) lval_print_push(" ", NULL);
 	}
-	putchar(close);
 }
 
 void lval_print_str(lval* v)
 {
-	char* escaped = malloc(strlen(v->str) + 1);
-	strcpy(escaped, v->str);
+	size_t len = lval_str_len(v);
+	char* escaped = malloc(len + 1);
+	memcpy(escaped, v->str, len + 1);
 	escaped = mpcf_escape(escaped);
 	printf("\"%s\"", escaped);
 	free(escaped);
 }
 
-void lval_print(lval* v)
+static void lval_print_one(lval* v)
 {
-	switch (v->type)
+	switch (lval_type(v))
 	{
 	case LVAL_FUN:
 		if (v->builtin)
@@ -254,33 +1029,73 @@ void lval_print(lval* v)
 		else
 		{
 			printf("(\\");
-			lval_print(v->formals);
-			putchar(' ');
-			lval_print(v->body);
-			putchar(')');
+			lval_print_push(")", NULL);
+			lval_print_push(NULL, v->body);
+			lval_print_push(" ", NULL);
+			lval_print_push(NULL, v->formals);
 		}
 		break;
 	case LVAL_NUM:
-		printf("%li", v->num);
+		printf("%li", lval_num_val(v));
 		break;
 	case LVAL_STR:
 		lval_print_str(v);
 		break;
 	case LVAL_ERR:
-		printf("Error : %s", v->err);
+		{
+			char msg[MAX_ERR];
+			lval_err_msg(v, msg, MAX_ERR);
+			printf("Error : %s", msg);
+		}
 		break;
 	case LVAL_SYM:
 		printf("%s", v->sym);
 		break;
 	case LVAL_SEXPR:
-		lval_print_expr(v, '(', ')');
+		putchar('(');
+		lval_print_cells(v, ")");
 		break;
 	case LVAL_QEXPR:
-		lval_print_expr(v, '{', '}');
+		putchar('{');
+		lval_print_cells(v, "}");
 		break;
 	}
 }
 
+/* Prints everything queued above 'base' */
+static void lval_print_run(int base)
+{
+	while (lval_printing.count > base)
+	{
+		lval* v = lstack_pop(&lval_printing);
+		char* text = lstack_pop(&lval_printing);
+		if (text)
+		{
+			fputs(text, stdout);
+		}
+		else
+		{
+			lval_print_one(v);
+		}
+	}
+}
+
+void lval_print_expr(lval* v, char open, char close)
+{
+	char end[2] = { close, '\0' };
+	int base = lval_printing.count;
+	putchar(open);
+	lval_print_cells(v, end);
+	lval_print_run(base);
+}
+
+void lval_print(lval* v)
+{
+	int base = lval_printing.count;
+	lval_print_push(NULL, v);
+	lval_print_run(base);
+}
+
 void lval_println(lval* v)
 {
 	lval_print(v);
@@ -310,29 +1125,38 @@ char* ltype_name(int t)
 	}
 }
 
-int lval_eq(lval* x, lval* y)
+/* Compares x and y without looking into their parts, the pairs of parts
+ * still to compare are left on 'todo' */
+static int lval_eq_one(lval* x, lval* y, lstack* todo)
 {
 
 	/* Different Types are always unequal */
-	if (x->type != y->type)
+	if (lval_type(x) != lval_type(y))
 	{
 		return 0;
 	}
 
 	/* Compare Based upon type */
-	switch (x->type)
+	switch (lval_type(x))
 	{
 		/* Compare Number Value */
 	case LVAL_NUM:
-		return (x->num == y->num);
+		return (lval_num_val(x) == lval_num_val(y));
 
-		/* Compare String Values */
+		/* Compare String Values, lengths first */
 	case LVAL_STR:
-		return (!strcmp(x->str, y->str));
+		return x->str == y->str
+			|| (lval_str_len(x) == lval_str_len(y)
+				&& !memcmp(x->str, y->str, lval_str_len(x)));
 	case LVAL_ERR:
-		return (!strcmp(x->err, y->err));
+		{
+			char xmsg[MAX_ERR], ymsg[MAX_ERR];
+			lval_err_msg(x, xmsg, MAX_ERR);
+			lval_err_msg(y, ymsg, MAX_ERR);
+			return (!strcmp(xmsg, ymsg));
+		}
 	case LVAL_SYM:
-		return (!strcmp(x->sym, y->sym));
+		return (x->sym == y->sym);
 
 		/* If builtin compare, otherwise compare formals and body */
 	case LVAL_FUN:
@@ -342,28 +1166,204 @@ int lval_eq(lval* x, lval* y)
 		}
 		else
 		{
-			return lval_eq(x->formals, y->formals)
-				&& lval_eq(x->body, y->body);
+			lstack_push(todo, x->formals);
+			lstack_push(todo, y->formals);
+			lstack_push(todo, x->body);
+			lstack_push(todo, y->body);
+			return 1;
 		}
 
 		/* If list compare every individual element */
 	case LVAL_QEXPR:
 	case LVAL_SEXPR:
+		/* Equal hash-consed lists are the same list */
+		if (x == y)
+		{
+			return 1;
+		}
+		if (x->flags & y->flags & LVAL_CONSED)
+		{
+			return 0;
+		}
 		if (x->count != y->count)
 		{
 			return 0;
 		}
-		for (int i = 0; i < x->count; i++)
+		/* Views of the same cells */
+		if (x->cell == y->cell)
 		{
-			/* If any element not equal then whole list not equal */
-			if (!lval_eq(x->cell[i], y->cell[i]))
-			{
-				return 0;
-			}
+			return 1;
+		}
+		/* Known hashes have to match */
+		if (x->hash && y->hash && x->hash != y->hash)
+		{
+			return 0;
+		}
+		/* Otherwise the lists are equal if every element is */
+		for (int i = x->count - 1; i >= 0; i--)
+		{
+			lstack_push(todo, x->cell[i]);
+			lstack_push(todo, y->cell[i]);
 		}
-		/* Otherwise lists must be equal */
 		return 1;
-		break;
 	}
 	return 0;
 }
+
+int lval_eq(lval* x, lval* y)
+{
+	static _Thread_local lstack todo;
+
+	int base = todo.count;
+	lstack_push(&todo, x);
+	lstack_push(&todo, y);
+	while (todo.count > base)
+	{
+		y = lstack_pop(&todo);
+		x = lstack_pop(&todo);
+		if (!lval_eq_one(x, y, &todo))
+		{
+			todo.count = base;
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static unsigned int lval_hash_mix(unsigned int h, unsigned long x)
+{
+	h ^= (unsigned int)(x ^ (x >> 32));
+	h *= 0x9E3779B1u;
+	return h ^ (h >> 15);
+}
+
+/* Hash of v if it needs no parts hashed first, otherwise 0 */
+static unsigned int lval_hash_one(lval* v)
+{
+	unsigned int h = lval_type(v) + 1;
+
+	switch (lval_type(v))
+	{
+	case LVAL_NUM:
+		h = lval_hash_mix(h, lval_num_val(v));
+		break;
+	case LVAL_STR:
+		if (v->flags & LVAL_INLINE)
+		{
+			h = lstr_hash_bytes(v->str, strlen(v->str));
+		}
+		else
+		{
+			h = lstr_hash(v->str);
+		}
+		break;
+	case LVAL_ERR:
+		{
+			char msg[MAX_ERR];
+			lval_err_msg(v, msg, MAX_ERR);
+			h = lval_hash_mix(h, lstr_hash_bytes(msg, strlen(msg)));
+		}
+		break;
+		/* Interned, the name is identified by its address */
+	case LVAL_SYM:
+		h = lval_hash_mix(h, (uintptr_t)v->sym);
+		break;
+	case LVAL_FUN:
+		if (!v->builtin) return 0;
+		h = lval_hash_mix(h, (uintptr_t)v->builtin);
+		break;
+		/* Lists keep their hash until their cells change */
+	case LVAL_QEXPR:
+	case LVAL_SEXPR:
+		return v->hash;
+	}
+	return h ? h : 1;
+}
+
+unsigned int lval_hash(lval* v)
+{
+	/* Pairs of a value and whether its parts are hashed, and the hashes
+	 * of finished parts in order */
+	static _Thread_local lstack todo;
+	static _Thread_local lstack done;
+
+	int base = todo.count;
+	lstack_push(&todo, NULL);
+	lstack_push(&todo, v);
+	while (todo.count > base)
+	{
+		v = lstack_pop(&todo);
+		int parts_done = lstack_pop(&todo) != NULL;
+		unsigned int h = parts_done ? 0 : lval_hash_one(v);
+
+		if (!h && !parts_done)
+		{
+			/* Come back to v once its parts are on 'done' */
+			lstack_push(&todo, v);
+			lstack_push(&todo, v);
+			if (lval_type(v) == LVAL_FUN)
+			{
+				lstack_push(&todo, NULL);
+				lstack_push(&todo, v->body);
+				lstack_push(&todo, NULL);
+				lstack_push(&todo, v->formals);
+			}
+			else
+			{
+				for (int i = v->count - 1; i >= 0; i--)
+				{
+					lstack_push(&todo, NULL);
+					lstack_push(&todo, v->cell[i]);
+				}
+			}
+			continue;
+		}
+
+		if (!h)
+		{
+			/* S- and Q-Expressions hash alike, so the retagging done by
+			 * list and eval leaves a cached hash valid */
+			int n = 2;
+			h = LVAL_FUN + 1;
+			if (lval_type(v) != LVAL_FUN)
+			{
+				n = v->count;
+				h = LVAL_QEXPR + 1;
+			}
+			done.count -= n;
+			for (int i = 0; i < n; i++)
+			{
+				h = lval_hash_mix(h, (uintptr_t)done.items[done.count + i]);
+			}
+			h = h ? h : 1;
+			if (lval_type(v) != LVAL_FUN) v->hash = h;
+		}
+		lstack_push(&done, (void*)(uintptr_t)h);
+	}
+	return (uintptr_t)lstack_pop(&done);
+}
+
+void lval_resolve(lval* v, lenv* frame)
+{
+	static _Thread_local lstack todo;
+
+	int base = todo.count;
+	lstack_push(&todo, v);
+	while (todo.count > base)
+	{
+		v = lstack_pop(&todo);
+		switch (lval_type(v))
+		{
+		case LVAL_SYM:
+			v->slot = lenv_index(frame, v->sym);
+			break;
+		case LVAL_SEXPR:
+		case LVAL_QEXPR:
+			for (int i = 0; i < v->count; i++)
+			{
+				lstack_push(&todo, v->cell[i]);
+			}
+			break;
+		}
+	}
+}
@@ -2,68 +2,255 @@
 #define LVAL_H
 #include <stdio.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
 
 #include "mpc.h"
+#include "lalloc.h"
 
 #define MAX_ERR (512)
 
 enum {LVAL_NUM, LVAL_ERR, LVAL_SYM, LVAL_SEXPR, LVAL_QEXPR, LVAL_FUN, LVAL_STR };
 
+/* Error codes. An error keeps its code and the arguments of the message,
+ * the text is only formatted when someone reads it (lval_err_msg). */
+enum
+{
+	LERR_CUSTOM,          /* text given by the user, see lval_err_str */
+	LERR_DIV_ZERO,
+	LERR_BAD_NUMBER,
+	LERR_UNBOUND,
+	LERR_ARG_TYPE,
+	LERR_ARG_COUNT,
+	LERR_ARG_EMPTY,
+	LERR_NOT_SYMBOL,
+	LERR_DEF_NOT_SYMBOL,
+	LERR_DEF_COUNT,
+	LERR_TOO_MANY_ARGS,
+	LERR_BAD_FORMALS,
+	LERR_NOT_FUNCTION,
+	LERR_NO_GC,
+	LERR_BAD_RANGE,
+	LERR_MEM_LIMIT,
+	LERR_COUNT
+};
+
+#define LERR_MAX_ARGS (4)
+
+/* Strings captured by an error must outlive it: literals, type names
+ * and interned symbols */
+typedef union lerr_arg
+{
+	long i;
+	const char* s;
+} lerr_arg;
+
 struct lval;
 struct lenv;
 typedef struct lval lval;
 typedef struct lenv lenv;
 typedef lval*(*lbuiltin)(lenv*, lval*);
 
+/* Every value starts with its type tag, followed by the payload of that
+ * type only. Constructors allocate just the tag plus the used member.
+ * Values are reference counted and shared, see lval_copy and lval_own. */
 struct lval
 {
-	int type;
-
-	/* Basic */
-	long num;
-	char * err;
-	char * sym;
-	char * str;
-
-	/* Function */
-	lbuiltin builtin;
-	lenv* env;
-	lval* formals;
-	lval* body;
-
-	/* Expression */
-	int count;
-	struct lval ** cell;
+	unsigned char type;
+	unsigned char flags;
+	unsigned int refs;
+
+	union
+	{
+		/* Basic */
+		long num;
+		char * str;
+
+		/* Symbol. 'slot' is where the name is expected in the table of
+		 * the environment it is evaluated in, -1 if unknown. 'global'
+		 * caches its slot in the global environment, valid while
+		 * 'version' matches. Both are checked by lenv_get. */
+		struct
+		{
+			char * sym;
+			int slot;
+			int global;
+			unsigned int version;
+		};
+
+		/* Error */
+		struct
+		{
+			int err;
+			lerr_arg args[LERR_MAX_ARGS];
+		};
+
+		/* Function */
+		struct
+		{
+			lbuiltin builtin;
+			lenv* env;
+			lval* formals;
+			lval* body;
+		};
+
+		/* Expression, a view of 'count' cells starting 'off' slots
+		 * into a cell array that other lists may share. 'hash' caches
+		 * lval_hash, 0 until computed or after the cells change. */
+		struct
+		{
+			int count;
+			int off;
+			unsigned int hash;
+			struct lval ** cell;
+		};
+	};
 };
 
+/* Cell arrays are shared between lists, a tail views the array of the
+ * list it came from. The array owns the values in its first 'len'
+ * slots, slots handed over by a front pop are left empty. */
+typedef struct lcells
+{
+	unsigned int refs;
+	int len;
+	int cap;
+	lval* data[];
+} lcells;
+
+/* Array holding the cells of an expression, if it has any */
+static inline lcells* lcells_of(lval* v)
+{
+	if (!v->cell) return NULL;
+	return (lcells*)((char*)(v->cell - v->off) - offsetof(lcells, data));
+}
+
+/* Drops a reference to b, the last one releases the values in it */
+void lcells_release(lcells* b);
+
+/* lval flags */
+#define LVAL_MARK (1 << 0)  /* reached by the collector, see lgc.h */
+#define LVAL_YOUNG (1 << 1) /* allocated in the nursery, see lalloc.h */
+#define LVAL_STATIC (1 << 2) /* preallocated, never freed */
+#define LVAL_INLINE (1 << 3) /* string text stored in the lval itself */
+#define LVAL_CONSED (1 << 4) /* the one copy of a hash-consed literal */
+
+/* Longest string kept inline, longer ones get a shared buffer (lstr.h) */
+#define LVAL_INLINE_MAX (15)
+
+/* Bytes needed for an lval whose last used member is 'field'. A value
+ * is allocated at the size lval_size gives for its type, so only the
+ * header and the members of its own type may be touched: never read
+ * another type's member, and never copy or assign a whole struct lval
+ * (only lerr_static holds full ones). Building with -DLALLOC_MALLOC and
+ * -fsanitize=address checks every access against the exact size. */
+#define LVAL_SIZE(field) \
+	(offsetof(lval, field) + sizeof(((lval*)0)->field))
+
+/* Small numbers are not allocated, they live in the pointer itself.
+ * An lval pointer with the low bit set is an immediate fixnum holding the
+ * value in the remaining bits; numbers out of that range are boxed. */
+#define LVAL_FIXNUM_MIN (LONG_MIN / 2)
+#define LVAL_FIXNUM_MAX (LONG_MAX / 2)
+
+static inline int lval_is_fixnum(const lval* v)
+{
+	return ((uintptr_t)v & 1);
+}
+
+static inline int lval_type(const lval* v)
+{
+	return lval_is_fixnum(v) ? LVAL_NUM : v->type;
+}
+
+static inline long lval_num_val(const lval* v)
+{
+	return lval_is_fixnum(v) ? (long)((intptr_t)v >> 1) : v->num;
+}
+
 lval* lval_num(long x);
 
-lval* lval_err(char* fmt, ...);
+lval* lval_err(int code, ...);
+
+lval* lval_err_str(char* s);
+
+void lval_err_msg(lval* v, char* buf, size_t size);
 
 lval* lval_sym(char* s);
 
 lval* lval_str(char* s);
 
+size_t lval_str_len(lval* v);
+
+/* The text of v as a string buffer reference, see lstr.h */
+char* lval_str_share(lval* v);
+
 lval* lval_builtin(lbuiltin fun);
 
 lval* lval_lambda(lval* formals, lval* body);
 
 lval* lval_sexpr(void);
 
+/* An empty S-Expression with room for n cells */
+lval* lval_sexpr_sized(int n);
+
 lval* lval_qexpr(void);
 
 void lval_del(lval* v);
 
+void lval_free(lval* v);
+
+/* Frees the memory of v itself once whatever it held is released */
+void lval_free_shell(lval* v);
+
+/* Arena mode, collector only. Everything allocated while a top-level
+ * form is evaluated goes in a region that is released in one go once the
+ * form is done. Values bound in the global environment have been
+ * promoted out of it by then (see lenv_put). */
+typedef struct lval_region
+{
+	lregion_mark mark;
+	int fin;
+	size_t bytes;
+	size_t objects;
+} lval_region;
+
+void lval_arena_enable(void);
+
+lval_region lval_region_begin(void);
+
+void lval_region_end(lval_region r);
+
 lval* lval_copy(lval* v);
 
+lval* lval_own(lval* v);
+
+/* Lists share cell arrays, this gives an owned v cells of its own */
+void lval_own_cells(lval* v);
+
+lval* lval_promote(lval* v);
+
+/* Opt-in hash-consing of quoted literals. The reader passes each
+ * Q-Expression it builds through lval_hashcons, which returns the single
+ * static copy of equal literals, so duplicates are stored once and
+ * compare by pointer. */
+void lval_hashcons_enable(void);
+
+lval* lval_hashcons(lval* v);
+
 lval* lval_add(lval* v, lval* x);
 
 lval* lval_join(lval* x, lval* y);
 
+/* Mutates v, the caller must hold the only reference (see lval_own) */
 lval* lval_pop(lval* v, int i);
 
 lval* lval_take(lval* v, int i);
 
+/* Cells start up to end of v, sharing v's cell array */
+lval* lval_slice(lval* v, int start, int end);
+
 void lval_print(lval* v);
 
 void lval_print_expr(lval* v, char open, char close);
@@ -75,4 +262,10 @@ void lval_println(lval* v);
 char* ltype_name(int t);
 
 int lval_eq(lval* x, lval* y);
+
+/* Structural hash, equal values hash equal. Never 0. */
+unsigned int lval_hash(lval* v);
+
+/* Points the symbols in v at their slots in frame, see lenv_get */
+void lval_resolve(lval* v, lenv* frame);
 #endif
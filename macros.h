@@ -1,19 +1,22 @@
 #ifndef MACROS_H
 #define MACROS_H
-#define LASSERT(args, cond, fmt, ...) \
-	if (!(cond)) { lval* err = lval_err(fmt, ##__VA_ARGS__); lval_del(args); return err; }
+#define LASSERT(args, cond, code, ...) \
+	if (!(cond)) { lval* err = lval_err(code, ##__VA_ARGS__); lval_del(args); return err; }
 
 #define LASSERT_TYPE(func, args, index, expect) \
-	LASSERT(args, args->cell[index]->type == expect, \
-			"Function '%s' passed incorrect type for argument %i, Got %s, Expected %s.", \
-			func, index, ltype_name(args->cell[index]->type), ltype_name(expect))
+	LASSERT(args, lval_type(args->cell[index]) == expect, LERR_ARG_TYPE, \
+			func, index, ltype_name(lval_type(args->cell[index])), ltype_name(expect))
 
 #define LASSERT_NUM(func, args, num) \
-	LASSERT(args, args->count == num, \
-			"Function '%s' passed incorrect number of arguments. Got %i, Expected %i.", \
+	LASSERT(args, args->count == num, LERR_ARG_COUNT, \
 			func, args->count, num)
 
 #define LASSERT_NOT_EMPTY(func, args, index) \
-	LASSERT(args, args->cell[index]->count != 0, \
-			"Function '%s' passed {} for argument %i.", func, index)
+	LASSERT(args, args->cell[index]->count != 0, LERR_ARG_EMPTY, func, index)
+
+/* Checks a {list} argument against the range start to end */
+#define LASSERT_RANGE(func, args, index, start, end) \
+	LASSERT(args, 0 <= (start) && (start) <= (end) \
+			&& (end) <= args->cell[index]->count, LERR_BAD_RANGE, \
+			func, (int)(start), (int)(end), args->cell[index]->count)
 #endif
@@ -1,11 +1,15 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 
 #include "macros.h"
 #include "lval.h"
 #include "lenv.h"
 #include "builtins.h"
+#include "lgc.h"
+#include "lstr.h"
+#include "lreap.h"
 
 /* If we are compiling on Windows compile these functions */
 #ifdef _WIN32
@@ -37,6 +41,7 @@ void add_history(char* unused) {}
 
 #define VERSIONINFO "clisp version 1.0.0.0"
 #define PROMPT "clisp>"
+#define GC_HEAP_DEFAULT (4 * 1024 * 1024)
 
 mpc_parser_t* Number;
 mpc_parser_t* Symbol;
@@ -68,17 +73,30 @@ lval* builtin_load(lenv* e, lval* a)
 		lval* expr = lval_read(r.output);
 		mpc_ast_delete(r.output);
 
-		/* Evaluate each Expression */
+		/* Only bindings into the top level are promoted out of a region
+		 * (lenv_put), so forms loaded from inside a call share the
+		 * region of the caller and wait for its safepoints */
+		int top = !e->par;
+
+		/* Evaluate each Expression, the rest stay rooted meanwhile */
+		lgc_push(e, expr);
 		while (expr->count)
 		{
+			lval_region region;
+			if (top) region = lval_region_begin();
 			lval* x = lval_eval(e, lval_pop(expr, 0));
 			/* If Evaluation leads to error print it */
-			if (x->type == LVAL_ERR)
+			if (lval_type(x) == LVAL_ERR)
 			{
 				lval_println(x);
 			}
 			lval_del(x);
+			if (!top) continue;
+			lval_region_end(region);
+			lreap_drain();
+			lgc_maybe_collect();
 		}
+		lgc_pop();
 
 		/* Delete expressions and arguments */
 		lval_del(expr);
@@ -95,7 +113,9 @@ lval* builtin_load(lenv* e, lval* a)
 		mpc_err_delete(r.error);
 
 		/* Create new error message using it */
-		lval* err = lval_err("Could not load Library %s", err_msg);
+		char msg[MAX_ERR];
+		snprintf(msg, MAX_ERR, "Could not load Library %s", err_msg);
+		lval* err = lval_err_str(lstr_new(msg, strlen(msg)));
 		free(err_msg);
 		lval_del(a);
 
@@ -109,8 +129,8 @@ lval* builtin_error(lenv* e, lval* a)
 	LASSERT_NUM("error", a, 1);
 	LASSERT_TYPE("error", a, 0, LVAL_STR);
 
-	/* Construct Error from first argument */
-	lval* err = lval_err(a->cell[0]->str);
+	/* Construct Error from first argument, sharing its text */
+	lval* err = lval_err_str(lval_str_share(a->cell[0]));
 
 	/* Delete arguments and return */
 	lval_del(a);
@@ -154,6 +174,9 @@ void lenv_add_builtins(lenv* e)
 	lenv_add_builtin(e, "list", builtin_list);
 	lenv_add_builtin(e, "head", builtin_head);
 	lenv_add_builtin(e, "tail", builtin_tail);
+	lenv_add_builtin(e, "take", builtin_take);
+	lenv_add_builtin(e, "drop", builtin_drop);
+	lenv_add_builtin(e, "slice", builtin_slice);
 	lenv_add_builtin(e, "eval", builtin_eval);
 	lenv_add_builtin(e, "join", builtin_join);
 
@@ -167,6 +190,7 @@ void lenv_add_builtins(lenv* e)
 	lenv_add_builtin(e, "if", builtin_if);
 	lenv_add_builtin(e, "==", builtin_eq);
 	lenv_add_builtin(e, "!=", builtin_ne);
+	lenv_add_builtin(e, "hash", builtin_hash);
 	lenv_add_builtin(e, ">",  builtin_gt);
 	lenv_add_builtin(e, "<",  builtin_lt);
 	lenv_add_builtin(e, ">=", builtin_ge);
@@ -176,6 +200,11 @@ void lenv_add_builtins(lenv* e)
 	lenv_add_builtin(e, "load",  builtin_load);
 	lenv_add_builtin(e, "error", builtin_error);
 	lenv_add_builtin(e, "print", builtin_print);
+
+	/* Memory Functions */
+	lenv_add_builtin(e, "alloc-stats", builtin_alloc_stats);
+	lenv_add_builtin(e, "mem-stats", builtin_mem_stats);
+	lenv_add_builtin(e, "gc", builtin_gc);
 	/* Shell Functions * /
 	   lenv_add_builtin(e, "exit", builtin_exit);*/
 }
@@ -210,33 +239,71 @@ int main(int argc, char ** argv)
 			clisp : /^/ <expr>* /$/ ; \
 			",
 			Number, Symbol, String, Comment, Expr, Clisp, Modifier, Sexpr, Qexpr);
+	/* Options come before the list of files */
+	int first = 1;
+	for (; first < argc && !strncmp(argv[first], "--", 2); first++)
+	{
+		if (!strcmp(argv[first], "--gc"))
+		{
+			lgc_enable(GC_HEAP_DEFAULT);
+		}
+		else if (!strncmp(argv[first], "--gc-heap=", 10))
+		{
+			lgc_enable(strtoul(argv[first] + 10, NULL, 10));
+		}
+		else if (!strncmp(argv[first], "--mem-limit=", 12))
+		{
+			lmem.limit = strtoul(argv[first] + 12, NULL, 10);
+		}
+		else if (!strcmp(argv[first], "--hashcons"))
+		{
+			lval_hashcons_enable();
+		}
+		else if (!strcmp(argv[first], "--arena"))
+		{
+			if (!lgc_on) lgc_enable(GC_HEAP_DEFAULT);
+			lval_arena_enable();
+		}
+		else
+		{
+			fprintf(stderr, "Unknown option %s\n", argv[first]);
+			return 1;
+		}
+	}
+
 	/* Version and exit info */
 	puts(VERSIONINFO);
 	puts("Enter exit () to exit\n");
 
 	lenv* e = lenv_new();
+	lenv_make_global(e);
 	lenv_add_builtins(e);
 
+	/* The global environment is the bottom of the root stack */
+	lgc_push(e, NULL);
+
 	/* Supplied with list of files */
-	if (argc >= 2)
+	if (argc > first)
 	{
 
-		/* loop over each supplied filename (starting from 1) */
-		for (int i = 1; i < argc; i++)
+		/* loop over each supplied filename */
+		for (int i = first; i < argc; i++)
 		{
 
 			/* Argument list with a single argument, the filename */
+			lval_region region = lval_region_begin();
 			lval* args = lval_add(lval_sexpr(), lval_str(argv[i]));
 
 			/* Pass to builtin load and get the result */
 			lval* x = builtin_load(e, args);
 
 			/* If the result is an error be sure to print it */
-			if (x->type == LVAL_ERR)
+			if (lval_type(x) == LVAL_ERR)
 			{
 				lval_println(x);
 			}
 			lval_del(x);
+			lval_region_end(region);
 		}
 	}
 
@@ -257,14 +324,20 @@ int main(int argc, char ** argv)
 			/*mpc_ast_print(r.output);
 			  mpc_ast_delete(r.output);*/
 			/*lval_println(eval(r.output));*/
-			lval* x = lval_eval(e, lval_read(r.output));
+			lval_region region = lval_region_begin();
+			lval* expr = lval_read(r.output);
+			lgc_push(e, expr);
+			lval* x = lval_eval(e, expr);
+			lgc_pop();
 			if (x)
 			{
 				lval_println(x);
 				lval_del(x);
+				lval_region_end(region);
 			}
 			else
 			{
+				lval_region_end(region);
 				printf("Bye Bye\n");
 				free(line);
 				break;
@@ -278,6 +351,8 @@ int main(int argc, char ** argv)
 		}
 
 		if (line) free(line);
+		lreap_drain();
+		lgc_maybe_collect();
 	}
 
 	lenv_del(e);